@@ -0,0 +1,313 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include "dirsyncfilter.h"
+
+#define MIN_TABLE_SIZE 4
+
+
+filterRules *makeFilter() {
+  filterRules *returnptr = calloc(1, sizeof(filterRules));
+  returnptr->compiled = 0;
+  return returnptr;
+}
+
+/******************************************************************
+ * tableAdd appends a copy of the len bytes at key to table, doubling
+ * the table's reservedSpace when it is full.
+ */
+static void tableAdd(patternTable *table, const char *key, size_t len) {
+  if((table->len + 1) > table->reservedSpace) {
+    unsigned int newsize = table->reservedSpace * 2;
+    table->reservedSpace = (newsize > MIN_TABLE_SIZE) ? newsize : MIN_TABLE_SIZE;
+    table->items = realloc(table->items, table->reservedSpace * sizeof(char *));
+  }
+
+  char *copy = calloc(len + 1, sizeof(char));
+  memcpy(copy, key, len);
+  table->items[table->len] = copy;
+  table->len++;
+}
+
+static int strComp(const void *s1, const void *s2) {
+  return strcmp(*(char **)s1, *(char **)s2);
+}
+
+/* prefixes are ordered by their first byte, suffixes by their last */
+static int firstByteComp(const void *s1, const void *s2) {
+  unsigned char c1 = **(char **)s1;
+  unsigned char c2 = **(char **)s2;
+  return (c1 != c2) ? c1 - c2 : strComp(s1, s2);
+}
+
+static int lastByteComp(const void *s1, const void *s2) {
+  char *str1 = *(char **)s1;
+  char *str2 = *(char **)s2;
+  unsigned char c1 = str1[strlen(str1) - 1];
+  unsigned char c2 = str2[strlen(str2) - 1];
+  return (c1 != c2) ? c1 - c2 : strcmp(str1, str2);
+}
+
+/******************************************************************
+ * compileTable sorts table with comp and, if last is 0 or 1, fills
+ * in the bucket index using the first or last byte of each key.
+ */
+static void compileTable(patternTable *table, int (*comp)(const void *, const void *), int last) {
+  unsigned int i, c;
+
+  if(table->len > 0) {
+    qsort(table->items, table->len, sizeof(char *), comp);
+  }
+
+  if(last < 0) {
+    return;
+  }
+
+  /*count the keys in each bucket, then turn the counts into start offsets*/
+  memset(table->bucket, 0, sizeof(table->bucket));
+  for(i = 0; i < table->len; i++) {
+    char *key = table->items[i];
+    c = (unsigned char)(last ? key[strlen(key) - 1] : key[0]);
+    table->bucket[c + 1]++;
+  }
+  for(c = 0; c < 256; c++) {
+    table->bucket[c + 1] += table->bucket[c];
+  }
+}
+
+static void freeTable(patternTable *table) {
+  unsigned int i;
+  for(i = 0; i < table->len; i++) {
+    free(table->items[i]);
+  }
+  free(table->items);
+}
+
+/******************************************************************
+ * addToSet works out the shape of pattern (with any trailing '/'
+ * already removed, len bytes long) and adds it to the matching
+ * table of set.
+ */
+static void addToSet(patternSet *set, const char *pattern, size_t len) {
+  size_t i, stars = 0;
+  int meta = 0;
+
+  for(i = 0; i < len; i++) {
+    if(pattern[i] == '*') {
+      stars++;
+    } else if(pattern[i] == '?' || pattern[i] == '[' || pattern[i] == '\\') {
+      meta = 1;
+    }
+  }
+
+  if(meta) {
+    tableAdd(&set->globs, pattern, len);
+  }
+  else if(stars == 0) {
+    tableAdd(&set->literals, pattern, len);
+  }
+  else if(len == 1) {
+    set->matchAll = 1; // "*"
+  }
+  else if(stars == 1 && pattern[len - 1] == '*') {
+    tableAdd(&set->prefixes, pattern, len - 1);
+  }
+  else if(stars == 1 && pattern[0] == '*') {
+    tableAdd(&set->suffixes, pattern + 1, len - 1);
+  }
+  else if(stars == 2 && len > 2 && pattern[0] == '*' && pattern[len - 1] == '*') {
+    tableAdd(&set->substrings, pattern + 1, len - 2);
+  }
+  else {
+    tableAdd(&set->globs, pattern, len);
+  }
+}
+
+int filterAddPattern(filterRules *filter, const char *pattern, int include) {
+  size_t len = strlen(pattern);
+  int dironly = 0;
+
+  if(len > 1 && pattern[len - 1] == '/') {
+    dironly = 1;
+    len--;
+  }
+
+  if(len == 0 || memchr(pattern, '/', len) != NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  patternSet *set;
+  if(include) {
+    set = dironly ? &filter->includeDirs : &filter->include;
+  } else {
+    set = dironly ? &filter->excludeDirs : &filter->exclude;
+  }
+
+  addToSet(set, pattern, len);
+  filter->compiled = 0;
+  return 0;
+}
+
+int filterAddFromFile(filterRules *filter, const char *path) {
+  FILE *fp;
+  char line[4096];
+  int result = 0;
+
+  if((fp = fopen(path, "r")) == NULL) {
+    return -1;
+  }
+
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    size_t len = strlen(line);
+
+    //strip the line ending, including a DOS one
+    while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+
+    if(len == 0 || line[0] == '#') {
+      continue;
+    }
+
+    if(strncmp(line, "+ ", 2) == 0) {
+      result |= filterAddPattern(filter, line + 2, 1);
+    } else if(strncmp(line, "- ", 2) == 0) {
+      result |= filterAddPattern(filter, line + 2, 0);
+    } else {
+      result |= filterAddPattern(filter, line, 0);
+    }
+  }
+
+  if(ferror(fp)) {
+    result = -1;
+  }
+  fclose(fp);
+  return result;
+}
+
+static void compileSet(patternSet *set) {
+  compileTable(&set->literals, strComp, -1);
+  compileTable(&set->prefixes, firstByteComp, 0);
+  compileTable(&set->suffixes, lastByteComp, 1);
+}
+
+void compileFilter(filterRules *filter) {
+  compileSet(&filter->include);
+  compileSet(&filter->exclude);
+  compileSet(&filter->includeDirs);
+  compileSet(&filter->excludeDirs);
+  filter->compiled = 1;
+}
+
+static int setIsEmpty(patternSet *set) {
+  return !set->matchAll && set->literals.len == 0 && set->prefixes.len == 0 &&
+    set->suffixes.len == 0 && set->substrings.len == 0 && set->globs.len == 0;
+}
+
+int filterHasDirRules(filterRules *filter) {
+  if(filter == NULL) {
+    return 0;
+  }
+  return !setIsEmpty(&filter->includeDirs) || !setIsEmpty(&filter->excludeDirs);
+}
+
+/******************************************************************
+ * setMatches returns 1 if the name, which is len bytes long, matches
+ * any pattern in set. The tables are tried from cheapest to most
+ * expensive, so fnmatch is only reached for names nothing else
+ * matched.
+ */
+static int setMatches(patternSet *set, const char *name, size_t len) {
+  unsigned int i;
+  unsigned char c;
+
+  if(set->matchAll) {
+    return 1;
+  }
+
+  if(set->literals.len > 0 &&
+     bsearch(&name, set->literals.items, set->literals.len, sizeof(char *), strComp) != NULL) {
+    return 1;
+  }
+
+  c = (unsigned char)name[0];
+  for(i = set->prefixes.bucket[c]; i < set->prefixes.bucket[c + 1]; i++) {
+    char *prefix = set->prefixes.items[i];
+    if(strncmp(name, prefix, strlen(prefix)) == 0) {
+      return 1;
+    }
+  }
+
+  c = (unsigned char)name[len - 1];
+  for(i = set->suffixes.bucket[c]; i < set->suffixes.bucket[c + 1]; i++) {
+    char *suffix = set->suffixes.items[i];
+    size_t suffixlen = strlen(suffix);
+    if(suffixlen <= len && memcmp(name + len - suffixlen, suffix, suffixlen) == 0) {
+      return 1;
+    }
+  }
+
+  for(i = 0; i < set->substrings.len; i++) {
+    if(strstr(name, set->substrings.items[i]) != NULL) {
+      return 1;
+    }
+  }
+
+  for(i = 0; i < set->globs.len; i++) {
+    if(fnmatch(set->globs.items[i], name, 0) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int filterExcluded(filterRules *filter, const char *name, int isdir) {
+  size_t len;
+
+  if(filter == NULL || name[0] == '\0') {
+    return 0;
+  }
+
+  if(!filter->compiled) {
+    compileFilter(filter);
+  }
+
+  len = strlen(name);
+
+  if(!setMatches(&filter->exclude, name, len) &&
+     !(isdir && setMatches(&filter->excludeDirs, name, len))) {
+    return 0;
+  }
+
+  /*an include pattern overrides any exclude pattern*/
+  if(setMatches(&filter->include, name, len) ||
+     (isdir && setMatches(&filter->includeDirs, name, len))) {
+    return 0;
+  }
+
+  return 1;
+}
+
+static void freeSet(patternSet *set) {
+  freeTable(&set->literals);
+  freeTable(&set->prefixes);
+  freeTable(&set->suffixes);
+  freeTable(&set->substrings);
+  freeTable(&set->globs);
+}
+
+void freeFilter(filterRules *tofree) {
+  if(tofree == NULL) {
+    return;
+  }
+
+  freeSet(&tofree->include);
+  freeSet(&tofree->exclude);
+  freeSet(&tofree->includeDirs);
+  freeSet(&tofree->excludeDirs);
+  free(tofree);
+}
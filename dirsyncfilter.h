@@ -0,0 +1,97 @@
+/******************************************************************
+ * A patternTable holds one class of compiled glob patterns. Each
+ * pattern is reduced to the literal part that has to be compared
+ * (the whole name, a prefix, a suffix or a substring), and prefix
+ * and suffix tables are bucketed by the byte they begin or end
+ * with, so a name only has to be compared against the patterns
+ * that could possibly match it. bucket[c] is the index of the
+ * first item whose key byte is c, and bucket[c+1] is one past
+ * the last.
+ */
+
+typedef struct patternTable {
+  char **items;
+  unsigned int len;
+  unsigned int reservedSpace;
+  unsigned int bucket[257];
+} patternTable;
+
+/******************************************************************
+ * A patternSet is a group of patterns sorted into tables by shape:
+ * exact names, "lit*" prefixes, "*lit" suffixes, "*lit*" substrings,
+ * and globs that need fnmatch. matchAll is set by the pattern "*".
+ */
+
+typedef struct patternSet {
+  int matchAll;
+  patternTable literals;
+  patternTable prefixes;
+  patternTable suffixes;
+  patternTable substrings;
+  patternTable globs;
+} patternSet;
+
+/******************************************************************
+ * filterRules holds the include and exclude patterns. Patterns
+ * written with a trailing '/' only match directories and are kept
+ * in the dir sets. An entry is filtered out when it matches an
+ * exclude pattern and does not match an include pattern.
+ */
+
+typedef struct filterRules {
+  patternSet include;
+  patternSet exclude;
+  patternSet includeDirs;
+  patternSet excludeDirs;
+  int compiled;
+} filterRules;
+
+/******************************************************************
+ * makeFilter returns a pointer to a new filterRules with no
+ * patterns in it.
+ */
+filterRules *makeFilter();
+
+/******************************************************************
+ * filterAddPattern adds pattern to filter as an include pattern if
+ * include is non-zero, or as an exclude pattern otherwise. Patterns
+ * are matched against single file names, so a pattern containing
+ * '/' anywhere except at the end is rejected: errno is set to
+ * EINVAL and -1 is returned. On success, 0 is returned.
+ */
+int filterAddPattern(filterRules *filter, const char *pattern, int include);
+
+/******************************************************************
+ * filterAddFromFile reads exclude patterns from the file named by
+ * path, one per line. Blank lines and lines starting with '#' are
+ * ignored, and lines starting with "+ " are added as include
+ * patterns. Returns -1, with errno set, if the file cannot be read
+ * or holds an invalid pattern, and 0 otherwise.
+ */
+int filterAddFromFile(filterRules *filter, const char *path);
+
+/******************************************************************
+ * compileFilter sorts and buckets the pattern tables. It must be
+ * called after the last pattern is added and before filterExcluded
+ * is used.
+ */
+void compileFilter(filterRules *filter);
+
+/******************************************************************
+ * filterHasDirRules returns non-zero if filter holds any
+ * directory-only patterns, in which case the caller has to know
+ * whether a name is a directory before calling filterExcluded.
+ */
+int filterHasDirRules(filterRules *filter);
+
+/******************************************************************
+ * filterExcluded returns 1 if the entry called name should be
+ * skipped, and 0 otherwise. isdir should be non-zero if the entry
+ * is a directory. A NULL filter excludes nothing.
+ */
+int filterExcluded(filterRules *filter, const char *name, int isdir);
+
+/******************************************************************
+ * freeFilter frees the given filterRules and all of its patterns.
+ */
+void freeFilter(filterRules *tofree);
@@ -0,0 +1,293 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "dirsyncjournal.h"
+
+#define MIN_JOURNAL_SIZE 4
+
+
+/******************************************************************
+ * makeKey returns a newly allocated "dir1\tdir2" key, with the two
+ * names in sorted order so that the key does not depend on which
+ * side dirsync was syncing from.
+ */
+static char *makeKey(const char *dir1, const char *dir2) {
+  if(strcmp(dir1, dir2) > 0) {
+    const char *swap = dir1;
+    dir1 = dir2;
+    dir2 = swap;
+  }
+
+  size_t keylen = strlen(dir1) + strlen(dir2) + 2;
+  char *key = calloc(keylen, sizeof(char));
+  snprintf(key, keylen, "%s\t%s", dir1, dir2);
+  return key;
+}
+
+static int keyComp(const void *k1, const void *k2) {
+  return strcmp(*(char **)k1, *(char **)k2);
+}
+
+static void addDone(journal *jnl, char *key) {
+  if((jnl->doneLen + 1) > jnl->doneReserved) {
+    unsigned int newsize = jnl->doneReserved * 2;
+    jnl->doneReserved = (newsize > MIN_JOURNAL_SIZE) ? newsize : MIN_JOURNAL_SIZE;
+    jnl->done = realloc(jnl->done, jnl->doneReserved * sizeof(char *));
+  }
+  jnl->done[jnl->doneLen++] = key;
+}
+
+partialFile *journalFindPartial(journal *jnl, const char *tmppath) {
+  unsigned int i;
+
+  if(jnl == NULL) {
+    return NULL;
+  }
+
+  //only a handful of copies are ever in progress, so a linear search will do
+  for(i = 0; i < jnl->partialLen; i++) {
+    if(strcmp(jnl->partials[i]->tmppath, tmppath) == 0) {
+      return jnl->partials[i];
+    }
+  }
+  return NULL;
+}
+
+static void setPartial(journal *jnl, const char *tmppath, off_t size, time_t mtime, off_t offset) {
+  partialFile *part = journalFindPartial(jnl, tmppath);
+
+  if(part == NULL) {
+    if((jnl->partialLen + 1) > jnl->partialReserved) {
+      unsigned int newsize = jnl->partialReserved * 2;
+      jnl->partialReserved = (newsize > MIN_JOURNAL_SIZE) ? newsize : MIN_JOURNAL_SIZE;
+      jnl->partials = realloc(jnl->partials, jnl->partialReserved * sizeof(partialFile *));
+    }
+
+    part = calloc(1, sizeof(partialFile));
+    part->tmppath = strdup(tmppath);
+    jnl->partials[jnl->partialLen++] = part;
+  }
+
+  part->size = size;
+  part->mtime = mtime;
+  part->offset = offset;
+}
+
+static void removePartial(journal *jnl, const char *tmppath) {
+  unsigned int i;
+
+  for(i = 0; i < jnl->partialLen; i++) {
+    if(strcmp(jnl->partials[i]->tmppath, tmppath) == 0) {
+      free(jnl->partials[i]->tmppath);
+      free(jnl->partials[i]);
+      jnl->partials[i] = jnl->partials[--jnl->partialLen];
+      return;
+    }
+  }
+}
+
+/******************************************************************
+ * appendRecord writes line to the end of the journal. A line that
+ * is cut short by a crash has no newline, and is skipped by
+ * loadJournal. If sync is non-zero the record is flushed to disk
+ * before returning.
+ */
+static void appendRecord(journal *jnl, const char *line, int sync) {
+  size_t len = strlen(line);
+  ssize_t written;
+
+  while(len > 0) {
+    written = write(jnl->fd, line, len);
+    if(written < 0) {
+      if(errno == EINTR) {
+	continue;
+      }
+      if(jnl->error == 0) {
+	jnl->error = errno;
+      }
+      return;
+    }
+    line += written;
+    len -= written;
+  }
+
+  if(sync) {
+    fdatasync(jnl->fd);
+  }
+}
+
+/******************************************************************
+ * loadJournal reads the records of an existing journal from fp.
+ * It returns 0 if the journal was written for dir1 and dir2, and
+ * -1 if it was not (or is empty), in which case nothing is loaded.
+ */
+static int loadJournal(journal *jnl, FILE *fp, const char *dir1, const char *dir2) {
+  char *line = NULL;
+  size_t linesize = 0;
+  ssize_t len;
+  int result = -1;
+
+  char *key = makeKey(dir1, dir2);
+
+  //the first line names the two directories being synced
+  if((len = getline(&line, &linesize, fp)) > 0 && line[len - 1] == '\n') {
+    line[len - 1] = '\0';
+    if(strncmp(line, JOURNAL_MAGIC "\t", strlen(JOURNAL_MAGIC) + 1) == 0 &&
+       strcmp(line + strlen(JOURNAL_MAGIC) + 1, key) == 0) {
+      result = 0;
+    }
+  }
+  free(key);
+
+  while(result == 0 && (len = getline(&line, &linesize, fp)) > 0) {
+    if(line[len - 1] != '\n') {
+      break; // torn write at the end of the journal
+    }
+    line[len - 1] = '\0';
+
+    if(strncmp(line, "done\t", 5) == 0) {
+      addDone(jnl, strdup(line + 5));
+    }
+    else if(strncmp(line, "part\t", 5) == 0) {
+      long long size, mtime, offset;
+      int pathstart = 0;
+      if(sscanf(line + 5, "%lld\t%lld\t%lld\t%n", &size, &mtime, &offset, &pathstart) == 3 && pathstart > 0) {
+	setPartial(jnl, line + 5 + pathstart, (off_t)size, (time_t)mtime, (off_t)offset);
+      }
+    }
+    else if(strncmp(line, "clear\t", 6) == 0) {
+      removePartial(jnl, line + 6);
+    }
+  }
+
+  free(line);
+
+  if(jnl->doneLen > 0) {
+    qsort(jnl->done, jnl->doneLen, sizeof(char *), keyComp);
+  }
+  return result;
+}
+
+journal *openJournal(const char *path, const char *dir1, const char *dir2) {
+  journal *jnl = calloc(1, sizeof(journal));
+  FILE *fp;
+  int resumed = 0;
+
+  jnl->path = strdup(path);
+
+  if((fp = fopen(path, "r")) != NULL) {
+    resumed = (loadJournal(jnl, fp, dir1, dir2) == 0);
+    fclose(fp);
+  }
+
+  /*a journal for some other sync is thrown away and started again*/
+  int flags = O_WRONLY | O_CREAT | O_APPEND | (resumed ? 0 : O_TRUNC);
+  if((jnl->fd = open(path, flags, S_IRUSR | S_IWUSR)) < 0) {
+    int openerror = errno;
+    closeJournal(jnl, 0);
+    errno = openerror;
+    return NULL;
+  }
+
+  if(!resumed) {
+    char *key = makeKey(dir1, dir2);
+    size_t headerlen = strlen(JOURNAL_MAGIC) + strlen(key) + 3;
+    char *header = calloc(headerlen, sizeof(char));
+    snprintf(header, headerlen, "%s\t%s\n", JOURNAL_MAGIC, key);
+    appendRecord(jnl, header, 1);
+    free(header);
+    free(key);
+  }
+
+  return jnl;
+}
+
+int journalSubtreeDone(journal *jnl, const char *dir1, const char *dir2) {
+  if(jnl == NULL || jnl->doneLen == 0) {
+    return 0;
+  }
+
+  char *key = makeKey(dir1, dir2);
+  int found = (bsearch(&key, jnl->done, jnl->doneLen, sizeof(char *), keyComp) != NULL);
+  free(key);
+  return found;
+}
+
+void journalMarkDone(journal *jnl, const char *dir1, const char *dir2) {
+  if(jnl == NULL || strchr(dir1, '\n') || strchr(dir2, '\n')) {
+    return; // names with newlines cannot be written as a record
+  }
+
+  char *key = makeKey(dir1, dir2);
+  size_t linelen = strlen(key) + 7;
+  char *line = calloc(linelen, sizeof(char));
+  snprintf(line, linelen, "done\t%s\n", key);
+  appendRecord(jnl, line, 0);
+  free(line);
+  free(key);
+}
+
+void journalCheckpoint(journal *jnl, const char *tmppath, off_t size, time_t mtime, off_t offset) {
+  if(jnl == NULL || strchr(tmppath, '\n')) {
+    return;
+  }
+
+  setPartial(jnl, tmppath, size, mtime, offset);
+
+  size_t linelen = strlen(tmppath) + 80;
+  char *line = calloc(linelen, sizeof(char));
+  snprintf(line, linelen, "part\t%lld\t%lld\t%lld\t%s\n", (long long)size, (long long)mtime, (long long)offset, tmppath);
+  appendRecord(jnl, line, 1);
+  free(line);
+}
+
+void journalClearPartial(journal *jnl, const char *tmppath) {
+  if(jnl == NULL || journalFindPartial(jnl, tmppath) == NULL) {
+    return;
+  }
+
+  removePartial(jnl, tmppath);
+
+  size_t linelen = strlen(tmppath) + 8;
+  char *line = calloc(linelen, sizeof(char));
+  snprintf(line, linelen, "clear\t%s\n", tmppath);
+  appendRecord(jnl, line, 0);
+  free(line);
+}
+
+void closeJournal(journal *jnl, int finished) {
+  unsigned int i;
+
+  if(jnl == NULL) {
+    return;
+  }
+
+  for(i = 0; i < jnl->partialLen; i++) {
+    if(finished) {
+      unlink(jnl->partials[i]->tmppath); // left behind by a copy that was never finished
+    }
+    free(jnl->partials[i]->tmppath);
+    free(jnl->partials[i]);
+  }
+  free(jnl->partials);
+
+  for(i = 0; i < jnl->doneLen; i++) {
+    free(jnl->done[i]);
+  }
+  free(jnl->done);
+
+  if(jnl->fd >= 0) {
+    close(jnl->fd);
+  }
+  if(finished) {
+    unlink(jnl->path);
+  }
+
+  free(jnl->path);
+  free(jnl);
+}
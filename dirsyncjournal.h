@@ -0,0 +1,89 @@
+#define JOURNAL_MAGIC "dirsync-journal 1"
+#define PARTIAL_SUFFIX ".dirsync-part"
+#define CHECKPOINT_BYTES (64L * 1024 * 1024)
+
+/******************************************************************
+ * A partialFile records how far the copy into the temporary file
+ * tmppath had got. size and mtime are those of the source file
+ * when the copy started, so a source that has changed since will
+ * not be resumed. offset is the number of bytes that were synced
+ * to disk when the record was written.
+ */
+
+typedef struct partialFile {
+  char *tmppath;
+  off_t size;
+  time_t mtime;
+  off_t offset;
+} partialFile;
+
+/******************************************************************
+ * A journal is an append-only log of a sync's progress. Each line
+ * is a record: "done" for a pair of directories that have been
+ * completely synced, "part" for a checkpoint of a large file copy,
+ * and "clear" once that copy has finished. Records read from an
+ * earlier, interrupted run are kept in done (a sorted array of
+ * "dir1\tdir2" keys) and partials, and new records are appended
+ * to the file through fd. error holds the errno value of the first
+ * append that failed, or 0.
+ */
+
+typedef struct journal {
+  char *path;
+  int fd;
+  int error;
+  char **done;
+  unsigned int doneLen;
+  unsigned int doneReserved;
+  partialFile **partials;
+  unsigned int partialLen;
+  unsigned int partialReserved;
+} journal;
+
+/******************************************************************
+ * openJournal opens the journal at path for a sync of dir1 and
+ * dir2. If the file holds a journal left by an interrupted sync of
+ * the same two directories, its records are loaded so the sync can
+ * be resumed; a journal for any other directories is discarded.
+ * Returns NULL, with errno set, if the journal cannot be opened.
+ */
+journal *openJournal(const char *path, const char *dir1, const char *dir2);
+
+/******************************************************************
+ * journalSubtreeDone returns 1 if the interrupted run recorded
+ * that dir1 and dir2 (in either order) had been completely synced,
+ * and 0 otherwise.
+ */
+int journalSubtreeDone(journal *jnl, const char *dir1, const char *dir2);
+
+/******************************************************************
+ * journalMarkDone records that dir1 and dir2 have been completely
+ * synced.
+ */
+void journalMarkDone(journal *jnl, const char *dir1, const char *dir2);
+
+/******************************************************************
+ * journalFindPartial returns the last checkpoint recorded for
+ * tmppath, or NULL if there is none.
+ */
+partialFile *journalFindPartial(journal *jnl, const char *tmppath);
+
+/******************************************************************
+ * journalCheckpoint records that the first offset bytes of tmppath,
+ * a copy of a source file with the given size and mtime, are on
+ * disk. The caller must have synced those bytes first.
+ */
+void journalCheckpoint(journal *jnl, const char *tmppath, off_t size, time_t mtime, off_t offset);
+
+/******************************************************************
+ * journalClearPartial records that the copy into tmppath is no
+ * longer in progress.
+ */
+void journalClearPartial(journal *jnl, const char *tmppath);
+
+/******************************************************************
+ * closeJournal closes the journal and frees it. If finished is
+ * non-zero the sync ran to the end, so any temporary files still
+ * named in the journal are removed, along with the journal itself.
+ */
+void closeJournal(journal *jnl, int finished);
@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "dirsyncrenames.h"
+
+#define MIN_RENAMETABLE_SIZE 4
+
+
+static void tableAdd(renameTable *table, renameRecord *record) {
+  if((table->len + 1) > table->reservedSpace) {
+    unsigned int newsize = table->reservedSpace * 2;
+    table->reservedSpace = (newsize > MIN_RENAMETABLE_SIZE) ? newsize : MIN_RENAMETABLE_SIZE;
+    table->records = realloc(table->records, table->reservedSpace * sizeof(renameRecord));
+  }
+  table->records[table->len++] = *record;
+}
+
+static void tableClear(renameTable *table) {
+  unsigned int i;
+  for(i = 0; i < table->len; i++) {
+    free(table->records[i].path);
+  }
+  table->len = 0;
+}
+
+static unsigned int idBucket(renameMap *map, int side, dev_t dev, ino_t ino) {
+  unsigned long long h = ((unsigned long long)dev * 0x9e3779b97f4a7c15ULL) ^ (unsigned long long)ino;
+  h = (h ^ (h >> 29)) * 0xbf58476d1ce4e5b9ULL + side;
+  return (unsigned int)((h ^ (h >> 32)) % map->buckets);
+}
+
+static unsigned int sizeBucket(renameMap *map, int side, off_t size) {
+  unsigned long long h = ((unsigned long long)size * 0x9e3779b97f4a7c15ULL) + side;
+  return (unsigned int)((h ^ (h >> 32)) % map->buckets);
+}
+
+/*records are saved in (side, path) order, with records added later after earlier ones for the same path*/
+static int orderComp(const void *p1, const void *p2) {
+  renameRecord *r1 = *(renameRecord **)p1;
+  renameRecord *r2 = *(renameRecord **)p2;
+  int c;
+
+  if(r1->side != r2->side) {
+    return r1->side - r2->side;
+  }
+  if((c = strcmp(r1->path, r2->path)) != 0) {
+    return c;
+  }
+  return (r1 < r2) ? -1 : (r1 > r2);
+}
+
+/******************************************************************
+ * indexMap builds the two sets of hash chains over the old
+ * records, with one bucket for each record, and sorts byPath.
+ */
+static void indexMap(renameMap *map) {
+  unsigned int i, b;
+
+  map->buckets = (map->old.len > 0) ? map->old.len : 1;
+  map->byId = malloc(map->buckets * sizeof(int));
+  map->bySize = malloc(map->buckets * sizeof(int));
+  map->nextById = malloc(map->buckets * sizeof(int));
+  map->nextBySize = malloc(map->buckets * sizeof(int));
+  map->byPath = malloc(map->buckets * sizeof(renameRecord *));
+
+  for(b = 0; b < map->buckets; b++) {
+    map->byId[b] = -1;
+    map->bySize[b] = -1;
+  }
+
+  for(i = 0; i < map->old.len; i++) {
+    renameRecord *rec = &map->old.records[i];
+
+    b = idBucket(map, rec->side, rec->dev, rec->ino);
+    map->nextById[i] = map->byId[b];
+    map->byId[b] = i;
+
+    b = sizeBucket(map, rec->side, rec->size);
+    map->nextBySize[i] = map->bySize[b];
+    map->bySize[b] = i;
+    
+    map->byPath[i] = rec;
+  }
+  qsort(map->byPath, map->old.len, sizeof(renameRecord *), orderComp);
+}
+
+/******************************************************************
+ * makeHeader returns the first line of a map for dir1 and dir2,
+ * without its newline, in a newly allocated string.
+ */
+static char *makeHeader(const char *dir1, const char *dir2) {
+  size_t headerlen = strlen(RENAMES_MAGIC) + strlen(dir1) + strlen(dir2) + 3;
+  char *header = calloc(headerlen, sizeof(char));
+  snprintf(header, headerlen, "%s\t%s\t%s", RENAMES_MAGIC, dir1, dir2);
+  return header;
+}
+
+renameMap *loadRenameMap(const char *path, const char *dir1, const char *dir2) {
+  renameMap *map = calloc(1, sizeof(renameMap));
+  FILE *fp;
+  char *line = NULL;
+  size_t linesize = 0;
+  ssize_t len;
+
+  map->path = strdup(path);
+
+  if((fp = fopen(path, "r")) == NULL) {
+    if(errno != ENOENT) {
+      int openerror = errno;
+      freeRenameMap(map);
+      errno = openerror;
+      return NULL;
+    }
+  }
+  else {
+    char *header = makeHeader(dir1, dir2);
+    int matched = 0;
+
+    //the first line names the two directories, in order, since records are kept by side
+    if((len = getline(&line, &linesize, fp)) > 0 && line[len - 1] == '\n') {
+      line[len - 1] = '\0';
+      matched = (strcmp(line, header) == 0);
+    }
+    free(header);
+
+    while(matched && (len = getline(&line, &linesize, fp)) > 0) {
+      renameRecord rec;
+      long long dev, ino, size, mtime;
+      int pathstart = 0;
+
+      if(line[len - 1] != '\n') {
+	break;
+      }
+      line[len - 1] = '\0';
+
+      if(sscanf(line, "%d\t%d\t%lld\t%lld\t%lld\t%lld\t%llx\t%n", &rec.side, &rec.isdir, &dev, &ino,
+		&size, &mtime, &rec.hash, &pathstart) != 7 || pathstart == 0) {
+	continue;
+      }
+
+      rec.dev = (dev_t)dev;
+      rec.ino = (ino_t)ino;
+      rec.size = (off_t)size;
+      rec.mtime = (time_t)mtime;
+      rec.path = strdup(line + pathstart);
+      tableAdd(&map->old, &rec);
+    }
+
+    free(line);
+    fclose(fp);
+  }
+
+  indexMap(map);
+  return map;
+}
+
+renameRecord *renameFindId(renameMap *map, int side, dev_t dev, ino_t ino) {
+  int i;
+
+  for(i = map->byId[idBucket(map, side, dev, ino)]; i >= 0; i = map->nextById[i]) {
+    renameRecord *rec = &map->old.records[i];
+    if(rec->side == side && rec->dev == dev && rec->ino == ino) {
+      return rec;
+    }
+  }
+  return NULL;
+}
+
+renameRecord *renameFindSize(renameMap *map, int side, off_t size, renameRecord *after) {
+  int i;
+
+  if(after == NULL) {
+    i = map->bySize[sizeBucket(map, side, size)];
+  } else {
+    i = map->nextBySize[after - map->old.records];
+  }
+
+  for(; i >= 0; i = map->nextBySize[i]) {
+    renameRecord *rec = &map->old.records[i];
+    if(rec->side == side && rec->size == size) {
+      return rec;
+    }
+  }
+  return NULL;
+}
+
+/******************************************************************
+ * pathBound returns the index in byPath of the first old record 
+ * that is not before (side, path).
+ */
+static unsigned int pathBound(renameMap *map, int side, const char *path) {
+  unsigned int low = 0, high = map->old.len;
+  
+  while(low < high) {
+    unsigned int mid = low + (high - low) / 2;
+    renameRecord *rec = map->byPath[mid];
+    if(rec->side < side || (rec->side == side && strcmp(rec->path, path) < 0)) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+renameRecord **renameFindChildren(renameMap *map, int side, const char *dir, unsigned int *count) {
+  size_t len = strlen(dir);
+  char *key = malloc(len + 2);
+  unsigned int first;
+  
+  //every path below dir sorts from "dir/" up to, but not including, "dir0"
+  memcpy(key, dir, len);
+  key[len] = '/';
+  key[len + 1] = '\0';
+  first = pathBound(map, side, key);
+  key[len] = '/' + 1;
+  *count = pathBound(map, side, key) - first;
+  
+  free(key);
+  return map->byPath + first;
+}
+
+void renameAdd(renameMap *map, int side, const char *path, struct stat *itemstat) {
+  renameRecord rec;
+
+  if(strchr(path, '\n')) {
+    return; // names with newlines cannot be saved
+  }
+
+  rec.side = side;
+  rec.isdir = S_ISDIR(itemstat->st_mode);
+  rec.dev = itemstat->st_dev;
+  rec.ino = itemstat->st_ino;
+  rec.size = rec.isdir ? 0 : itemstat->st_size;
+  rec.mtime = itemstat->st_mtime;
+  rec.hash = 0;
+  rec.path = strdup(path);
+  tableAdd(&map->current, &rec);
+}
+
+void renameClearCurrent(renameMap *map) {
+  tableClear(&map->current);
+}
+
+int saveRenameMap(renameMap *map, const char *dir1, const char *dir2) {
+  size_t tmplen = strlen(map->path) + 5;
+  char *tmppath = calloc(tmplen, sizeof(char));
+  renameRecord **order = malloc((map->current.len + 1) * sizeof(renameRecord *));
+  unsigned int i;
+  FILE *fp;
+
+  snprintf(tmppath, tmplen, "%s.tmp", map->path);
+
+  if((fp = fopen(tmppath, "w")) == NULL) {
+    free(tmppath);
+    free(order);
+    return -1;
+  }
+
+  char *header = makeHeader(dir1, dir2);
+  fprintf(fp, "%s\n", header);
+  free(header);
+
+  for(i = 0; i < map->current.len; i++) {
+    order[i] = &map->current.records[i];
+  }
+  qsort(order, map->current.len, sizeof(renameRecord *), orderComp);
+
+  for(i = 0; i < map->current.len; i++) {
+    renameRecord *rec = order[i];
+    renameRecord *saved;
+
+    //skip all but the last record for each path
+    if(i + 1 < map->current.len) {
+      renameRecord *next = order[i + 1];
+      if(next->side == rec->side && strcmp(next->path, rec->path) == 0) {
+	continue;
+      }
+    }
+
+    //an unchanged file keeps the hash computed for it by an earlier sync
+    if(rec->hash == 0 && (saved = renameFindId(map, rec->side, rec->dev, rec->ino)) != NULL &&
+       saved->size == rec->size && saved->mtime == rec->mtime) {
+      rec->hash = saved->hash;
+    }
+
+    fprintf(fp, "%d\t%d\t%lld\t%lld\t%lld\t%lld\t%llx\t%s\n", rec->side, rec->isdir, (long long)rec->dev,
+	    (long long)rec->ino, (long long)rec->size, (long long)rec->mtime, rec->hash, rec->path);
+  }
+
+  free(order);
+
+  if(ferror(fp) | fclose(fp)) {
+    int writeerror = errno;
+    unlink(tmppath);
+    free(tmppath);
+    errno = writeerror;
+    return -1;
+  }
+
+  if(rename(tmppath, map->path)) {
+    int renameerror = errno;
+    unlink(tmppath);
+    free(tmppath);
+    errno = renameerror;
+    return -1;
+  }
+
+  free(tmppath);
+  return 0;
+}
+
+void freeRenameMap(renameMap *tofree) {
+  if(tofree == NULL) {
+    return;
+  }
+
+  tableClear(&tofree->old);
+  tableClear(&tofree->current);
+  free(tofree->old.records);
+  free(tofree->current.records);
+  free(tofree->byId);
+  free(tofree->bySize);
+  free(tofree->nextById);
+  free(tofree->nextBySize);
+  free(tofree->byPath);
+  free(tofree->path);
+  free(tofree);
+}
@@ -0,0 +1,107 @@
+#define RENAMES_MAGIC "dirsync-renames 1"
+
+/******************************************************************
+ * A renameRecord is what is known about one file or directory on
+ * one side of a sync: side is 1 or 2, for the job's first or
+ * second directory, and path is relative to that directory. hash
+ * is a content hash of the file, or 0 if none has been computed.
+ */
+
+typedef struct renameRecord {
+  int side;
+  int isdir;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  unsigned long long hash;
+  char *path;
+} renameRecord;
+
+/******************************************************************
+ * A renameTable is a resizing array of renameRecords, like a
+ * fileList. It is not kept sorted.
+ */
+
+typedef struct renameTable {
+  renameRecord *records;
+  unsigned int len;
+  unsigned int reservedSpace;
+} renameTable;
+
+/******************************************************************
+ * A renameMap holds the records saved by the last sync of a pair
+ * of directories, in old, and the records for this sync, in
+ * current, which will replace them when the map is saved. old is
+ * indexed by (side, dev, ino) and by (side, size) through hash
+ * chains: byId[bucket] and bySize[bucket] hold the index of the
+ * first record in each chain, and nextById and nextBySize the
+ * index of the record after each one, with -1 ending a chain.
+ * byPath points to the old records sorted by (side, path).
+ */
+
+typedef struct renameMap {
+  char *path;
+  renameTable old;
+  renameTable current;
+  unsigned int buckets;
+  int *byId;
+  int *bySize;
+  int *nextById;
+  int *nextBySize;
+  renameRecord **byPath;
+} renameMap;
+
+/******************************************************************
+ * loadRenameMap reads the map saved at path by the last sync of
+ * dir1 and dir2. A missing file, or one saved for some other pair
+ * of directories, gives an empty map. Returns NULL, with errno
+ * set, if the file exists but cannot be read.
+ */
+renameMap *loadRenameMap(const char *path, const char *dir1, const char *dir2);
+
+/******************************************************************
+ * renameFindId returns the saved record for the file with the
+ * given dev and ino on side, or NULL if there is none.
+ */
+renameRecord *renameFindId(renameMap *map, int side, dev_t dev, ino_t ino);
+
+/******************************************************************
+ * renameFindSize returns the next saved record on side whose size
+ * is size, after the record after (or the first one, if after is
+ * NULL). It returns NULL when there are no more.
+ */
+renameRecord *renameFindSize(renameMap *map, int side, off_t size, renameRecord *after);
+
+/******************************************************************
+ * renameFindChildren returns the saved records on side for
+ * everything below the directory dir, at any depth, as an array of
+ * *count record pointers sorted by path.
+ */
+renameRecord **renameFindChildren(renameMap *map, int side, const char *dir, unsigned int *count);
+
+/******************************************************************
+ * renameAdd adds a record for this sync, for the file or directory
+ * at path on side, with the attributes in itemstat.
+ */
+void renameAdd(renameMap *map, int side, const char *path, struct stat *itemstat);
+
+/******************************************************************
+ * renameClearCurrent throws away the records for this sync.
+ */
+void renameClearCurrent(renameMap *map);
+
+/******************************************************************
+ * saveRenameMap writes the records for this sync to the map's
+ * file, replacing the old ones. Where there are several records
+ * for the same path, the last one added wins, and hashes are
+ * carried over from saved records for unchanged files. The file
+ * is written under a temporary name and renamed into place.
+ * Returns 0 on success, and -1 with errno set on error.
+ */
+int saveRenameMap(renameMap *map, const char *dir1, const char *dir2);
+
+/******************************************************************
+ * freeRenameMap frees the given renameMap and its records.
+ */
+void freeRenameMap(renameMap *tofree);
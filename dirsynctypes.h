@@ -1,5 +1,4 @@
 #define MIN_FILELIST_SIZE 4
-#define printOutput(args ...) if (printoutput) fprintf(stdout, args)
 
 /******************************************************************
  * A fileItem consists of two parts: a string to hold the name
@@ -0,0 +1,2100 @@
+#define _GNU_SOURCE // for O_DIRECT
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <utime.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+#include "dirsynctypes.h"
+#include "dirsyncfilter.h"
+#include "dirsyncjournal.h"
+#include "dirsyncrenames.h"
+#include "libdirsync.h"
+
+
+//TODO - avoid infinite loop
+
+#define DEFAULT_PATH_SIZE 1024 // the maximum path size used if pathconf fails to give a result
+#define MAX_PATH_SIZE 16384 // path buffers live on the worker's stack, so pathconf's answer is capped
+#define COPY_BUFFER_SIZE (256 * 1024)
+#define PROGRESS_BYTES (16L * 1024 * 1024)
+#define DIRECT_ALIGN 4096 // buffer, offset and length alignment that satisfies O_DIRECT on common filesystems
+#define DIRECT_MIN_BYTES (4L * 1024 * 1024) // smaller files are written through the page cache even with noCache
+#define DROP_BYTES (8L * 1024 * 1024)
+#define TEMP_NAME_KEEP 200 // bytes of a long name kept in its temporary name
+#define MAX_QUEUED_COPIES 65536 // the copy queue is sorted and run whenever it reaches this length
+#define QUEUE_BUCKETS 65536 // hash chains for finding a queued copy or fixup by its path
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/******************************************************************
+ * A dirsyncContext holds the settings shared by every job in a 
+ * batch. The filter is compiled before the workers start and is 
+ * only read after that. lock serialises calls to the callback and 
+ * protects nextjob and failed while a batch runs, and the buffer 
+ * pool at all times. The pool keeps the aligned copy buffers of 
+ * finished batches, for the workers of the next one.
+ */
+
+struct dirsyncContext {
+  int verbose;
+  int threads;
+  int renameHashing;
+  int noCache;
+  int extentOrder;
+  filterRules *filter;
+  dirsyncCallback callback;
+  void *userdata;
+  
+  pthread_mutex_t lock;
+  const dirsyncJob *jobs;
+  int njobs;
+  int nextjob;
+  int failed;
+  
+  char **pool;
+  int poolLen;
+  int poolReserved;
+};
+
+/******************************************************************
+ * A queuedCopy is a file copy that has been put off so that it can 
+ * be done in the order of the source's position on disk. item is 
+ * the source file, in the directory src, and it is to be copied to 
+ * the directory dest. position is the physical offset of the file's 
+ * first extent if located is set, and its inode number if not. next 
+ * is the index of the next copy in the same hash chain, or -1.
+ */
+
+typedef struct queuedCopy {
+  char *src;
+  char *dest;
+  fileItem item;
+  int located;
+  unsigned long long position;
+  int next;
+} queuedCopy;
+
+/******************************************************************
+ * A dirFixup is a directory whose permissions and times must be 
+ * set again after the copy queue has run, since copying files into 
+ * it changes its modification time. next is the index of the next 
+ * fixup in the same hash chain, or -1.
+ */
+
+typedef struct dirFixup {
+  char *path;
+  struct stat itemStat;
+  int next;
+} dirFixup;
+
+/******************************************************************
+ * A dirsyncWorker is the state of one worker thread. It is passed 
+ * down through every function that does the syncing, in place of 
+ * global variables. jobindex, job, pathsize, syncjournal, renames 
+ * and ownFiles, the stat structs of the job's journal and rename 
+ * map, belong to the job being run, while buffer is taken from the context's pool for the whole 
+ * batch and used for every file the worker copies. errors counts the 
+ * errors reported for the current job. When copies are ordered by 
+ * extent, queue holds the copies put off so far, and fixups the 
+ * directories whose times have to be set once they are done. 
+ * queueIndex and fixupIndex hold the first entry of each of their 
+ * hash chains, keyed by destination path, and doneKeys the pairs 
+ * of directories that will be finished once the queue has run, as 
+ * pairs of strings. With noCache set, drops 
+ * holds the small files copied since their pages were last dropped, 
+ * and dropBytes their total size.
+ */
+
+typedef struct dirsyncWorker {
+  dirsyncContext *ctx;
+  int jobindex;
+  const dirsyncJob *job;
+  long pathsize;
+  journal *syncjournal;
+  renameMap *renames;
+  struct stat ownFiles[2];
+  int ownFileCount;
+  char *buffer;
+  int errors;
+  
+  queuedCopy *queue;
+  unsigned int queueLen;
+  unsigned int queueReserved;
+  int *queueIndex;
+  dirFixup *fixups;
+  unsigned int fixupLen;
+  unsigned int fixupReserved;
+  int *fixupIndex;
+  char **doneKeys;
+  unsigned int doneLen;
+  unsigned int doneReserved;
+  char **drops;
+  unsigned int dropLen;
+  unsigned int dropReserved;
+  off_t dropBytes;
+} dirsyncWorker;
+
+static int dirsync(dirsyncWorker *w, char *, char *);
+static void flushQueue(dirsyncWorker *w);
+
+/******************************************************************
+ * emitEvent fills in the job index of event and passes it to the 
+ * context's callback, holding the context's lock so that the 
+ * callback is only ever running on one thread.
+ */
+static void emitEvent(dirsyncWorker *w, dirsyncEvent *event) {
+  dirsyncContext *ctx = w->ctx;
+  
+  if(ctx->callback == NULL) {
+    return;
+  }
+  
+  event->job = w->jobindex;
+  pthread_mutex_lock(&ctx->lock);
+  ctx->callback(event, ctx->userdata);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/******************************************************************
+ * printOutput formats a line of verbose output, printf style, and 
+ * reports it as a DIRSYNC_EVENT_MESSAGE. Nothing is formatted 
+ * unless verbose output is on.
+ */
+static void printOutput(dirsyncWorker *w, const char *format, ...) {
+  va_list args;
+  char small[256];
+  char *message = small;
+  int len;
+  
+  if(!w->ctx->verbose || w->ctx->callback == NULL) {
+    return;
+  }
+  
+  va_start(args, format);
+  len = vsnprintf(small, sizeof(small), format, args);
+  va_end(args);
+  
+  //most messages fit in small, but those with long paths need a bigger buffer
+  if(len >= (int)sizeof(small) && (message = malloc(len + 1)) != NULL) {
+    va_start(args, format);
+    vsnprintf(message, len + 1, format, args);
+    va_end(args);
+  } else if(message == NULL) {
+    message = small;
+  }
+  
+  dirsyncEvent event = {DIRSYNC_EVENT_MESSAGE};
+  event.message = message;
+  emitEvent(w, &event);
+  
+  if(message != small) {
+    free(message);
+  }
+}
+
+/******************************************************************
+ * printError reports an error as a DIRSYNC_EVENT_ERROR. It is called 
+ * by giving the name of the function or action that is being 
+ * performed, and the argument that is being operated on when 
+ * the error arises. The error itself is taken from errno.
+ */
+static void printError(dirsyncWorker *w, char *function, char *arg)
+{
+  dirsyncEvent event = {DIRSYNC_EVENT_ERROR};
+  event.function = function;
+  event.path = arg;
+  event.error = errno;
+  w->errors++;
+  emitEvent(w, &event);
+}
+
+/******************************************************************
+ * emitCopy reports a DIRSYNC_EVENT_COPY_* or DIRSYNC_EVENT_MKDIR 
+ * event for the copy of path to destpath.
+ */
+static void emitCopy(dirsyncWorker *w, dirsyncEventType type, char *path, char *destpath, off_t bytes) {
+  dirsyncEvent event = {type};
+  event.path = path;
+  event.destpath = destpath;
+  event.bytes = bytes;
+  emitEvent(w, &event);
+}
+
+/******************************************************************
+ * makeAbsPath concatenates the strings given by the dir and file 
+ * arguments, with a '/' separator, and returns the new string.
+ */
+static char *makeAbsPath(char *str, char *dir, char *file) {
+  sprintf(str, "%s%c%s", dir, '/', file);
+  return str;
+}
+
+/******************************************************************
+ * pathSide works out which of the job's two directories path is in, 
+ * returning 1 or 2 (or 0 if it is in neither) and setting *rel to 
+ * the rest of the path below that directory. If one directory is 
+ * inside the other, the deeper one wins.
+ */
+static int pathSide(dirsyncWorker *w, const char *path, const char **rel) {
+  const char *roots[2] = {w->job->dir1, w->job->dir2};
+  size_t best = 0;
+  int side = 0, i;
+  
+  for(i = 0; i < 2; i++) {
+    size_t len = strlen(roots[i]);
+    if(strncmp(path, roots[i], len) != 0) {
+      continue;
+    }
+    if(len > 0 && roots[i][len - 1] != '/' && path[len] != '/' && path[len] != '\0') {
+      continue;
+    }
+    if(side == 0 || len > best) {
+      side = i + 1;
+      best = len;
+    }
+  }
+  
+  if(side) {
+    *rel = path + best;
+    while(**rel == '/') {
+      (*rel)++;
+    }
+  }
+  return side;
+}
+
+/******************************************************************
+ * makeSidePath builds the path of rel inside the job's directory 
+ * number side.
+ */
+static char *makeSidePath(dirsyncWorker *w, char *str, int side, const char *rel) {
+  sprintf(str, "%s/%s", (side == 1) ? w->job->dir1 : w->job->dir2, rel);
+  return str;
+}
+
+/******************************************************************
+ * recordItem adds the regular file or directory at path to the rename 
+ * map's records for this sync, if the job keeps a rename map. It is 
+ * called for whatever dirsync creates, so that the next sync knows 
+ * the copies as well as the originals.
+ */
+static void recordItem(dirsyncWorker *w, char *path) {
+  struct stat itemstat;
+  const char *rel;
+  int side;
+  
+  if(w->renames == NULL || (side = pathSide(w, path, &rel)) == 0) {
+    return;
+  }
+  
+  if(lstat(path, &itemstat) == 0 && (S_ISREG(itemstat.st_mode) || S_ISDIR(itemstat.st_mode))) {
+    renameAdd(w->renames, side, rel, &itemstat);
+  }
+}
+
+/******************************************************************
+ * addOwnFile records the file at path, if it exists, as one of the 
+ * job's own files, which are never synced. isOwnFile returns 1 if 
+ * itemstat is for one of them. Files are matched by device and inode 
+ * rather than by name, so that a file elsewhere with the same name 
+ * as the journal is still synced.
+ */
+static void addOwnFile(dirsyncWorker *w, const char *path) {
+  if(w->ownFileCount < 2 && lstat(path, &w->ownFiles[w->ownFileCount]) == 0) {
+    w->ownFileCount++;
+  }
+}
+
+static int isOwnFile(dirsyncWorker *w, struct stat *itemstat) {
+  int i;
+  for(i = 0; i < w->ownFileCount; i++) {
+    if(w->ownFiles[i].st_dev == itemstat->st_dev && w->ownFiles[i].st_ino == itemstat->st_ino) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/******************************************************************
+ * makeDirectory makes a Directory from the filesystem directory 
+ * with the name dirname. The dirlist argument is a pointer to 
+ * a directory to which fileLists will be added. An entry that is 
+ * removed between readdir and lstat is left out. On error, 
+ * makeDirectory returns -1, and on success, it returns 0.
+ */
+static int makeDirectory(dirsyncWorker *w, char *dirname, Directory *dirlist) {
+  DIR *dir_ptr;
+  struct dirent *dirent_ptr;
+  struct stat thisstat;
+  
+  char path[w->pathsize];
+  
+  dirlist->files = makeList();
+  dirlist->subdirs = makeList();
+  
+  if((dir_ptr = opendir(dirname)) == NULL) {
+    printError(w, "opendir", dirname);
+    return -1;
+  }
+  
+  if(lstat(dirname,&thisstat)) {
+    printError(w, "stat",dirname);
+    closedir(dir_ptr);
+    return -1;
+  }
+  
+  else {
+    
+    while((dirent_ptr = readdir(dir_ptr)) != NULL) {
+      makeAbsPath(path,dirname,dirent_ptr->d_name);
+      
+      int statted = 0;
+      
+      /* Filter on the name before calling lstat, so excluded entries cost nothing 
+       * and excluded directories are never opened. '.' and '..' are always kept. */
+      if(w->ctx->filter && strcmp(dirent_ptr->d_name,".") != 0 && strcmp(dirent_ptr->d_name,"..") != 0) {
+	int isdir = -1;
+	
+#ifdef _DIRENT_HAVE_D_TYPE
+	if(dirent_ptr->d_type != DT_UNKNOWN) {
+	  isdir = (dirent_ptr->d_type == DT_DIR);
+	}
+#endif
+	
+	//only stat first if a directory-only pattern needs to know the type
+	if(isdir < 0 && filterHasDirRules(w->ctx->filter)) {
+	  if(lstat(path, &thisstat)) {
+	    if(errno == ENOENT) {
+	      continue;
+	    }
+	    printError(w, "stat",path);
+	    closedir(dir_ptr);
+	    return -1;
+	  }
+	  statted = 1;
+	  isdir = S_ISDIR(thisstat.st_mode);
+	}
+	
+	if(filterExcluded(w->ctx->filter, dirent_ptr->d_name, isdir > 0)) {
+	  printOutput(w, "Excluded %s in directory %s\n", dirent_ptr->d_name, dirname);
+	  continue;
+	}
+      }
+      
+      if(!statted && lstat(path, &thisstat)) {
+	if(errno == ENOENT) {
+	  continue; // removed since readdir
+	}
+	printError(w, "stat",path);
+	closedir(dir_ptr);
+	return -1;  
+      }
+      
+      //the job's own journal and rename map are never synced
+      if(isOwnFile(w, &thisstat)) {
+	continue;
+      }
+      
+      
+      switch(thisstat.st_mode & S_IFMT) {
+	//directories are added to the subdirs list
+	case S_IFDIR:
+	  addFile(dirlist->subdirs, dirent_ptr->d_name, &thisstat);
+	  break;
+	  
+	  //symlinks and files are added to the files list
+	case S_IFLNK:
+	case S_IFREG:
+	  addFile(dirlist->files, dirent_ptr->d_name, &thisstat);
+	  break;
+	  
+	  
+	default:
+	  printOutput(w, "Ignored unhandled file type %s in directory %s\n",dirent_ptr->d_name, dirname);
+	  break;
+      }
+    }
+    closedir(dir_ptr);
+  }
+  
+  return 0;
+}
+/******************************************************************
+ * copyStat copies the permission and time attributes from the stat 
+ * struct pointed to by stat to the file pointed to by path.
+ */
+static void copyStat(dirsyncWorker *w, char *path, struct stat *stat) {
+  
+  //To change file protection, use chmod function
+  if(chmod(path,stat->st_mode)) {
+    printError(w, "chmod",path);
+  }
+  
+  //To change file access and modification times, use the utime function
+  struct utimbuf time;
+  
+  time.modtime = stat->st_mtime;
+  time.actime = stat->st_atime;
+  
+  if(utime(path,&time) < 0) {
+    printError(w, "utime",path);
+  }
+  
+}
+
+/******************************************************************
+ * fnvHash adds the len bytes at data to the 64-bit FNV-1a hash 
+ * hash, which starts at FNV_OFFSET, and returns the result.
+ */
+static unsigned long long fnvHash(unsigned long long hash, const char *data, size_t len) {
+  size_t i;
+  
+  for(i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+/******************************************************************
+ * makeTempPath builds the name that file is copied to in dir before 
+ * it is renamed into place. The name ends in PARTIAL_SUFFIX, which 
+ * dirsyncCreate adds to the exclude patterns so that leftovers from 
+ * an interrupted copy are never synced themselves. A name too long 
+ * to take the prefix and suffix is cut short and followed by a hash 
+ * of the whole name, so the temporary name stays within NAME_MAX and 
+ * is still the same every time the file is copied.
+ */
+static char *makeTempPath(char *str, char *dir, char *file) {
+  size_t len = strlen(file);
+  
+  if(len + 1 + strlen(PARTIAL_SUFFIX) <= NAME_MAX) {
+    sprintf(str, "%s/.%s%s", dir, file, PARTIAL_SUFFIX);
+  } else {
+    unsigned long long hash = fnvHash(FNV_OFFSET, file, len);
+    sprintf(str, "%s/.%.*s-%016llx%s", dir, TEMP_NAME_KEEP, file, hash, PARTIAL_SUFFIX);
+  }
+  return str;
+}
+
+/******************************************************************
+ * setDirect turns O_DIRECT on or off for the open file fd. It 
+ * returns -1 if the system or the filesystem does not support it.
+ */
+static int setDirect(int fd, int on) {
+#ifdef O_DIRECT
+  int flags = fcntl(fd, F_GETFL);
+  if(flags < 0) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFL, on ? (flags | O_DIRECT) : (flags & ~O_DIRECT));
+#else
+  errno = EINVAL;
+  return -1;
+#endif
+}
+
+/******************************************************************
+ * dropCache tells the kernel that the len bytes of fd from start 
+ * will not be needed again, so their pages can be freed. For a file 
+ * that has been written, the pages are flushed to disk first, since 
+ * dirty pages cannot be dropped.
+ */
+static void dropCache(int fd, off_t start, off_t len, int written) {
+  if(len <= 0) {
+    return;
+  }
+  if(written) {
+    fdatasync(fd);
+  }
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(fd, start, len, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/******************************************************************
+ * writeBack starts writing the dirty pages of fd to disk, without 
+ * waiting for them unless wait is set. Unlike fdatasync, it does not 
+ * flush the disk's cache or the filesystem journal, so it is cheap 
+ * enough to use for every file. Without sync_file_range, it falls 
+ * back to fdatasync when asked to wait, and does nothing otherwise.
+ */
+static void writeBack(int fd, int wait) {
+#ifdef SYNC_FILE_RANGE_WRITE
+  if(wait) {
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+  } else {
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+  }
+#else
+  if(wait) {
+    fdatasync(fd);
+  }
+#endif
+}
+
+/******************************************************************
+ * runDrops drops the pages of every file in the worker's drops from 
+ * the page cache. Their write-back was started as each was copied, 
+ * so by now there is little or nothing left to wait for.
+ */
+static void runDrops(dirsyncWorker *w) {
+  unsigned int i;
+  int fd;
+  
+  for(i = 0; i < w->dropLen; i++) {
+    if((fd = open(w->drops[i], O_RDONLY)) >= 0) {
+      writeBack(fd, 1);
+#ifdef POSIX_FADV_DONTNEED
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+      close(fd);
+    }
+    free(w->drops[i]);
+  }
+  w->dropLen = 0;
+  w->dropBytes = 0;
+}
+
+/******************************************************************
+ * addDrop records that the small file at path, of size bytes, was 
+ * written through the page cache, and drops the pages of the files 
+ * recorded so far once they add up to DROP_BYTES.
+ */
+static void addDrop(dirsyncWorker *w, char *path, off_t size) {
+  if((w->dropLen + 1) > w->dropReserved) {
+    unsigned int newsize = w->dropReserved * 2;
+    w->dropReserved = (newsize > MIN_FILELIST_SIZE) ? newsize : MIN_FILELIST_SIZE;
+    w->drops = realloc(w->drops, w->dropReserved * sizeof(char *));
+  }
+  
+  w->drops[w->dropLen++] = strdup(path);
+  w->dropBytes += size;
+  
+  if(w->dropBytes >= DROP_BYTES) {
+    runDrops(w);
+  }
+}
+
+/******************************************************************
+ * copyData copies everything from fdsrc, starting at offset, to the 
+ * same offset in fddest, through the worker's buffer, reporting 
+ * progress every PROGRESS_BYTES. When a journal is being kept, the 
+ * bytes copied so far are synced to disk and checkpointed every 
+ * CHECKPOINT_BYTES, so that an interrupted copy of a large file can 
+ * be resumed from there. 
+ * 
+ * With noCache set, the copy tries not to push other data out of the 
+ * page cache: the source is read sequentially and its pages dropped 
+ * every DROP_BYTES, and files of DIRECT_MIN_BYTES or more are written 
+ * with O_DIRECT where the filesystem allows it. The buffer is 
+ * DIRECT_ALIGN aligned, and O_DIRECT is turned off for a final block 
+ * that is not a whole number of DIRECT_ALIGN units, or if a write is 
+ * refused. Anything else written without O_DIRECT is flushed and 
+ * dropped like the source. A file smaller than DIRECT_MIN_BYTES only 
+ * has its write-back started, and its pages are dropped later, with 
+ * other small files, by addDrop, so that copying many small files 
+ * does not wait for a disk flush after each one. Returns 0 on 
+ * success and -1 on error.
+ */
+static int copyData(dirsyncWorker *w, int fdsrc, int fddest, char *srcpath, char *destpath, char *tmppath, struct stat *srcstat, off_t offset) {
+  char *buffer = w->buffer;
+  ssize_t readlen, written, done;
+  off_t checkpointed = offset;
+  off_t reported = offset;
+  off_t dropped = offset;
+  int nocache = w->ctx->noCache;
+  int direct = 0;
+  
+  if(nocache) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fdsrc, offset, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    if(srcstat->st_size >= DIRECT_MIN_BYTES && offset % DIRECT_ALIGN == 0) {
+      direct = (setDirect(fddest, 1) == 0);
+    }
+  }
+  
+  while((readlen = read(fdsrc, buffer, COPY_BUFFER_SIZE)) != 0) {
+    if(readlen < 0) {
+      if(errno == EINTR) {
+	continue;
+      }
+      printError(w, "read",srcpath);
+      return -1;
+    }
+    
+    //O_DIRECT can only write whole blocks
+    if(direct && readlen % DIRECT_ALIGN != 0) {
+      setDirect(fddest, 0);
+      direct = 0;
+    }
+    
+    for(done = 0; done < readlen; done += written) {
+      written = write(fddest, buffer + done, readlen - done);
+      if(written < 0) {
+	if(errno == EINTR) {
+	  written = 0;
+	  continue;
+	}
+	if(errno == EINVAL && direct) {
+	  setDirect(fddest, 0); // the filesystem accepted O_DIRECT but not the write
+	  direct = 0;
+	  written = 0;
+	  continue;
+	}
+	printError(w, "write",tmppath);
+	return -1;
+      }
+    }
+    offset += readlen;
+    
+    if(nocache && offset - dropped >= DROP_BYTES) {
+      dropCache(fdsrc, dropped, offset - dropped, 0);
+      if(!direct) {
+	dropCache(fddest, dropped, offset - dropped, 1);
+      }
+      dropped = offset;
+    }
+    
+    if(w->syncjournal && offset - checkpointed >= CHECKPOINT_BYTES) {
+      if(fdatasync(fddest) == 0) {
+	journalCheckpoint(w->syncjournal, tmppath, srcstat->st_size, srcstat->st_mtime, offset);
+	checkpointed = offset;
+      }
+    }
+    
+    if(offset - reported >= PROGRESS_BYTES) {
+      emitCopy(w, DIRSYNC_EVENT_COPY_PROGRESS, srcpath, destpath, offset);
+      reported = offset;
+    }
+  }
+  
+  if(nocache) {
+    dropCache(fdsrc, dropped, offset - dropped, 0);
+    if(srcstat->st_size >= DIRECT_MIN_BYTES) {
+      dropCache(fddest, dropped, offset - dropped, 1);
+    } else {
+      writeBack(fddest, 0);
+    }
+  }
+  
+  return 0;
+}
+
+/******************************************************************
+ * discardTemp removes the temporary file at tmppath after a failed 
+ * copy, unless the journal holds a checkpoint for it that the next 
+ * run can resume from. Leftover temporary names are excluded from 
+ * every sync, so nothing else would ever remove them.
+ */
+static void discardTemp(dirsyncWorker *w, char *tmppath) {
+  if(journalFindPartial(w->syncjournal, tmppath) == NULL) {
+    unlink(tmppath);
+  }
+}
+
+/******************************************************************
+ * copyFile copies the file in the location src to the location dest.
+ * The data is written to a temporary name, which gets the source's 
+ * modification time and permissions from copyStat and is then renamed 
+ * over the destination, so an interrupted copy never leaves a 
+ * truncated file with a new modification time behind. If the journal 
+ * holds a checkpoint for the temporary file, and the source has not 
+ * changed since, the copy carries on from the checkpointed offset.
+ */
+static int copyFile(dirsyncWorker *w, char *src, char *dest, fileItem *file) {
+  
+  char srcpath[w->pathsize];
+  char destpath[w->pathsize];
+  char tmppath[w->pathsize];
+  char linkpath[w->pathsize];
+  
+  makeAbsPath(srcpath,src,file->name);
+  makeAbsPath(destpath,dest,file->name);
+  makeTempPath(tmppath,dest,file->name);
+  
+  if((file->itemStat.st_mode & S_IFMT) == S_IFLNK) {
+    //it is a symlink
+    size_t link;
+    printOutput(w, "Copying symlink %s\n",file->name);
+    
+    link = readlink(srcpath, linkpath, w->pathsize - 1);
+    if((int)link < 0) {
+      printError(w, "readlink",src);
+      return -1;
+    }
+    
+    linkpath[link] = '\0';
+    
+    printOutput(w, "Trying to create %s from %s\n\n",destpath,linkpath);
+    emitCopy(w, DIRSYNC_EVENT_COPY_START, srcpath, destpath, 0);
+    
+    //create the link under the temporary name, so that renaming it replaces an older link
+    unlink(tmppath);
+    int linkcheck;
+    if((linkcheck = symlink(linkpath,tmppath)) < 0) {
+      printError(w, "symlink",tmppath);
+      return -1;
+    }
+    
+    if(rename(tmppath,destpath)) {
+      printError(w, "rename",destpath);
+      unlink(tmppath);
+      return -1;
+    }
+    
+    emitCopy(w, DIRSYNC_EVENT_COPY_DONE, srcpath, destpath, 0);
+    return 0;
+    
+  } else {
+    int fdsrc, fddest = -1;
+    off_t offset = 0;
+    partialFile *part;
+    struct stat tmpstat;
+    
+    //open srcpath for reading
+    if((fdsrc = open(srcpath, O_RDONLY)) < 0) {
+      printError(w, "open",srcpath);
+      return -1;
+    }
+    
+    /*Resume from the last checkpoint if the source is unchanged and the 
+     *temporary file still holds at least the checkpointed bytes*/
+    part = journalFindPartial(w->syncjournal, tmppath);
+    if(part && part->size == file->itemStat.st_size && part->mtime == file->itemStat.st_mtime &&
+       (fddest = open(tmppath, O_WRONLY)) >= 0) {
+      if(fstat(fddest, &tmpstat) == 0 && tmpstat.st_size >= part->offset && ftruncate(fddest, part->offset) == 0 &&
+	 lseek(fddest, part->offset, SEEK_SET) == part->offset && lseek(fdsrc, part->offset, SEEK_SET) == part->offset) {
+	offset = part->offset;
+      } else {
+	close(fddest);
+	fddest = -1;
+	lseek(fdsrc, 0, SEEK_SET);
+      }
+    }
+    
+    if(offset > 0) {
+      printOutput(w, "Resuming copy of file %s of size %ld bytes from %s to %s at byte %ld\n\n", file->name, (long)file->itemStat.st_size, srcpath, destpath, (long)offset);
+    } else {
+      printOutput(w, "Copying file %s of size %ld bytes from %s to %s\n\n", file->name, (long)file->itemStat.st_size, srcpath, destpath);
+      
+      //open the temporary file for writing
+      if((fddest = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0) {
+	printError(w, "open",tmppath);
+	close(fdsrc);
+	return -1;
+      }
+    }
+    
+    emitCopy(w, DIRSYNC_EVENT_COPY_START, srcpath, destpath, offset);
+    
+    //on error the temporary file is only kept if a checkpointed copy can be resumed
+    if(copyData(w, fdsrc, fddest, srcpath, destpath, tmppath, &file->itemStat, offset)) {
+      close(fdsrc);
+      close(fddest);
+      discardTemp(w, tmppath);
+      return -1;
+    }
+    
+    close(fdsrc);
+    if(close(fddest)) {
+      printError(w, "close",tmppath);
+      discardTemp(w, tmppath);
+      return -1;
+    }
+    
+    copyStat(w, tmppath, &file->itemStat);
+    
+    if(rename(tmppath,destpath)) {
+      printError(w, "rename",destpath);
+      discardTemp(w, tmppath);
+      return -1;
+    }
+    
+    journalClearPartial(w->syncjournal, tmppath);
+    recordItem(w, destpath);
+    if(w->ctx->noCache && file->itemStat.st_size < DIRECT_MIN_BYTES) {
+      addDrop(w, destpath, file->itemStat.st_size);
+    }
+    emitCopy(w, DIRSYNC_EVENT_COPY_DONE, srcpath, destpath, file->itemStat.st_size);
+    
+    return 0;
+  }
+}
+
+/******************************************************************
+ * locateFile finds where the data of the file at path starts on 
+ * disk, using the FIEMAP ioctl, and stores it in copy's position. 
+ * Where FIEMAP is not available, or the file has no extents, the 
+ * inode number is used instead, since filesystems tend to place 
+ * the data of files with nearby inodes close together.
+ */
+static void locateFile(queuedCopy *copy, char *path) {
+  copy->located = 0;
+  copy->position = copy->item.itemStat.st_ino;
+  
+#ifdef FS_IOC_FIEMAP
+  struct fiemap *map;
+  int fd;
+  
+  if((fd = open(path, O_RDONLY)) < 0) {
+    return;
+  }
+  
+  //room for the first extent only
+  map = calloc(1, sizeof(struct fiemap) + sizeof(struct fiemap_extent));
+  map->fm_start = 0;
+  map->fm_length = FIEMAP_MAX_OFFSET;
+  map->fm_extent_count = 1;
+  
+  if(ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0) {
+    copy->located = 1;
+    copy->position = map->fm_extents[0].fe_physical;
+  }
+  free(map);
+  close(fd);
+#endif
+}
+
+/******************************************************************
+ * pathBucket returns the hash chain for the path dir/name in a 
+ * queueIndex or fixupIndex. makeIndex allocates an index with every 
+ * chain empty, and clearIndex empties all of its chains again.
+ */
+static unsigned int pathBucket(const char *dir, const char *name) {
+  unsigned long long hash = fnvHash(FNV_OFFSET, dir, strlen(dir));
+  hash = fnvHash(hash, "/", 1);
+  return (unsigned int)(fnvHash(hash, name, strlen(name)) % QUEUE_BUCKETS);
+}
+
+static void clearIndex(int *index) {
+  if(index != NULL) {
+    memset(index, 0xff, QUEUE_BUCKETS * sizeof(int)); // every chain starts at -1
+  }
+}
+
+static int *makeIndex() {
+  int *index = malloc(QUEUE_BUCKETS * sizeof(int));
+  clearIndex(index);
+  return index;
+}
+
+/******************************************************************
+ * scheduleCopy copies file from src to dest, like copyFile. When 
+ * copies are ordered by extent, regular files are put on the 
+ * worker's queue instead, along with where their data is on disk, 
+ * and the queue is run once it reaches MAX_QUEUED_COPIES. The 
+ * directories the copies go into already exist by then, since 
+ * moveNeededDirs creates them before going into them.
+ * 
+ * dirsync goes into each pair of subdirectories from both sides, 
+ * and the second time round a queued file is still missing from 
+ * the disk, so a copy to a destination that is already queued is 
+ * skipped rather than queued again.
+ */
+static void scheduleCopy(dirsyncWorker *w, char *src, char *dest, fileItem *file) {
+  char srcpath[w->pathsize];
+  queuedCopy *copy;
+  unsigned int bucket;
+  int i;
+  
+  if(!w->ctx->extentOrder || !S_ISREG(file->itemStat.st_mode)) {
+    copyFile(w, src, dest, file);
+    return;
+  }
+  
+  bucket = pathBucket(dest, file->name);
+  if(w->queueIndex == NULL) {
+    w->queueIndex = makeIndex();
+  }
+  for(i = w->queueIndex[bucket]; i >= 0; i = w->queue[i].next) {
+    if(strcmp(w->queue[i].item.name, file->name) == 0 && strcmp(w->queue[i].dest, dest) == 0) {
+      return;
+    }
+  }
+  
+  if((w->queueLen + 1) > w->queueReserved) {
+    unsigned int newsize = w->queueReserved * 2;
+    w->queueReserved = (newsize > MIN_FILELIST_SIZE) ? newsize : MIN_FILELIST_SIZE;
+    w->queue = realloc(w->queue, w->queueReserved * sizeof(queuedCopy));
+  }
+  
+  copy = &w->queue[w->queueLen++];
+  copy->src = strdup(src);
+  copy->dest = strdup(dest);
+  copy->item.name = strdup(file->name);
+  copy->item.itemStat = file->itemStat;
+  copy->next = w->queueIndex[bucket];
+  w->queueIndex[bucket] = w->queueLen - 1;
+  locateFile(copy, makeAbsPath(srcpath, src, file->name));
+  
+  printOutput(w, "Queued copy of %s from %s to %s\n", file->name, src, dest);
+  
+  if(w->queueLen >= MAX_QUEUED_COPIES) {
+    flushQueue(w);
+  }
+}
+
+/******************************************************************
+ * queueComp orders queued copies by source device, then by position 
+ * on that device, with the files that FIEMAP could not locate after 
+ * the rest, in inode order.
+ */
+static int queueComp(const void *c1, const void *c2) {
+  const queuedCopy *copy1 = c1;
+  const queuedCopy *copy2 = c2;
+  
+  if(copy1->item.itemStat.st_dev != copy2->item.itemStat.st_dev) {
+    return (copy1->item.itemStat.st_dev < copy2->item.itemStat.st_dev) ? -1 : 1;
+  }
+  if(copy1->located != copy2->located) {
+    return copy2->located - copy1->located;
+  }
+  if(copy1->position != copy2->position) {
+    return (copy1->position < copy2->position) ? -1 : 1;
+  }
+  return 0;
+}
+
+/******************************************************************
+ * runQueue sorts the worker's queued copies by where their data is 
+ * on disk, so that the source is read mostly sequentially instead 
+ * of seeking between files, and then does them.
+ */
+static void runQueue(dirsyncWorker *w) {
+  unsigned int i;
+  
+  if(w->queueLen == 0) {
+    return;
+  }
+  
+  printOutput(w, "\nCopying %u queued files in disk order\n\n", w->queueLen);
+  qsort(w->queue, w->queueLen, sizeof(queuedCopy), queueComp);
+  
+  for(i = 0; i < w->queueLen; i++) {
+    queuedCopy *copy = &w->queue[i];
+    copyFile(w, copy->src, copy->dest, &copy->item);
+    free(copy->src);
+    free(copy->dest);
+    free(copy->item.name);
+  }
+  w->queueLen = 0;
+  clearIndex(w->queueIndex);
+}
+
+/******************************************************************
+ * addFixup records that the directory at path should be given the 
+ * permissions and times in itemstat once the queue has run. If path 
+ * already has a fixup, its itemstat is replaced, as copyStat would 
+ * have done when the directory was synced again.
+ */
+static void addFixup(dirsyncWorker *w, char *path, struct stat *itemstat) {
+  unsigned int bucket = pathBucket(path, "");
+  int i;
+  
+  if(w->fixupIndex == NULL) {
+    w->fixupIndex = makeIndex();
+  }
+  for(i = w->fixupIndex[bucket]; i >= 0; i = w->fixups[i].next) {
+    if(strcmp(w->fixups[i].path, path) == 0) {
+      w->fixups[i].itemStat = *itemstat;
+      return;
+    }
+  }
+  
+  if((w->fixupLen + 1) > w->fixupReserved) {
+    unsigned int newsize = w->fixupReserved * 2;
+    w->fixupReserved = (newsize > MIN_FILELIST_SIZE) ? newsize : MIN_FILELIST_SIZE;
+    w->fixups = realloc(w->fixups, w->fixupReserved * sizeof(dirFixup));
+  }
+  
+  w->fixups[w->fixupLen].path = strdup(path);
+  w->fixups[w->fixupLen].itemStat = *itemstat;
+  w->fixups[w->fixupLen].next = w->fixupIndex[bucket];
+  w->fixupIndex[bucket] = w->fixupLen;
+  w->fixupLen++;
+}
+
+/******************************************************************
+ * runFixups sets the permissions and times of each directory 
+ * recorded by addFixup, in the order they were first recorded.
+ */
+static void runFixups(dirsyncWorker *w) {
+  unsigned int i;
+  
+  for(i = 0; i < w->fixupLen; i++) {
+    copyStat(w, w->fixups[i].path, &w->fixups[i].itemStat);
+    free(w->fixups[i].path);
+  }
+  w->fixupLen = 0;
+  clearIndex(w->fixupIndex);
+}
+
+/******************************************************************
+ * printTimes prints the modification times of srcItem and destItem 
+ * before one is copied over the other. ctime_r is used because ctime 
+ * returns a buffer shared by every thread.
+ */
+static void printTimes(dirsyncWorker *w, fileItem *srcItem, fileItem *destItem) {
+  char timestr[32];
+  
+  if(!w->ctx->verbose) {
+    return;
+  }
+  printOutput(w, "Source: %s\n", ctime_r(&(srcItem->itemStat.st_mtime), timestr));
+  printOutput(w, "Dest: %s\n", ctime_r(&(destItem->itemStat.st_mtime), timestr));
+}
+
+/******************************************************************
+ * moveNeededFiles takes four arguments. One Directory is regarded
+ * as the source, and the other as the destination. Any files present 
+ * in the source that are not in the destination will be copied to the 
+ * destination. srcDir and destDir should point to Directory structs, where
+ * src and dest are the pathnames to the directories.
+ */
+static void moveNeededFiles(dirsyncWorker *w, Directory *srcDir, char *src, Directory *destDir, char *dest) {
+  
+  fileList *srcFileArray = srcDir->files;
+  fileList *destFileArray = destDir->files;
+  
+  fileItem *srcItem, *destItem;
+  int i;
+  
+  for(i = 0; i < srcDir->files->len; i++) {
+    srcItem = srcFileArray->dataStart[i];
+    destItem = itemFind(destFileArray, srcItem);
+    
+    /*If the file was not found, it should be copied and the name should be added to the list of destination files*/
+    if(!destItem) {
+      printOutput(w, "%s does not exist in destination directory: copying\n", srcItem->name);
+      scheduleCopy(w, src,dest,srcItem);
+      addFile(destFileArray, srcItem->name, &srcItem->itemStat);
+    }
+    
+    /*For symlinks, since we do not set the time when we create them, we use what they point to 
+     *     in order to determine whether they should be copied*/
+    
+    else if((srcItem->itemStat.st_mode & S_IFMT) == S_IFLNK) {
+      
+      size_t link;
+      int linkcomp;
+      char srcpath[w->pathsize];
+      char destpath[w->pathsize];
+      char srclinkpath[w->pathsize];
+      char destlinkpath[w->pathsize];
+      
+      makeAbsPath(srcpath,src,srcItem->name);
+      makeAbsPath(destpath,dest,destItem->name);
+      
+      link = readlink(srcpath, srclinkpath, w->pathsize - 1);
+      
+      if((int)link < 0) {
+	printError(w, "readlink",src);
+	continue;
+      }
+      
+      srclinkpath[link] = '\0'; //null terminate
+      
+      link = readlink(destpath, destlinkpath, w->pathsize - 1);
+      
+      if((int)link < 0) {
+	printError(w, "readlink",src);
+	continue;
+      }
+      
+      destlinkpath[link] = '\0'; //null terminate
+      
+      linkcomp = strcmp(srclinkpath,destlinkpath);
+      
+      /*If they point to the same thing, do nothing */
+      if(linkcomp == 0) {
+	printOutput(w, "Symlinks %s and %s both point to %s. Doing nothing.\n", srcpath,destpath,srclinkpath);
+	continue;
+      }
+      
+      /*Otherwise, copy the newer link to the other directory*/
+      else {
+	printOutput(w, "Src points to %s\nDest points to %s\nCopying newer symlink.\n", srclinkpath, destlinkpath);
+	if(srcItem->itemStat.st_mtime > destItem->itemStat.st_mtime) {
+	  continue; // if they do happen to have the same mod time, do nothing.
+	}
+	
+	else if(srcItem->itemStat.st_mtime > destItem->itemStat.st_mtime) {
+	  printTimes(w, srcItem, destItem);
+	  printOutput(w, "Source version of %s newer than destination version: copying\n", destItem->name);
+	  scheduleCopy(w, src,dest,srcItem);
+	  
+	} else {
+	  printTimes(w, srcItem, destItem);
+	  printOutput(w, "Destination version of %s newer than source version: copying\n", destItem->name);
+	  scheduleCopy(w, dest,src,destItem);
+	  
+	}
+      }
+    }
+    
+    /* For regular files, if the mod times are the same but the sizes are different, 
+     *    just print this and do nothing. If the times and sizes are the same, still do nothing. */
+    
+    else if(srcItem->itemStat.st_mtime == destItem->itemStat.st_mtime) {
+      if(srcItem->itemStat.st_size != destItem->itemStat.st_size) {
+	printOutput(w, "Error: mod time for file %s and file %s are the same but file sizes are different. Doing nothing\n", srcItem->name, destItem->name);
+	continue;
+      } else {
+	printOutput(w, "File %s is the same in both directories. Doing nothing\n", destItem->name);
+	continue;
+      }
+    }
+    
+    /* If the modification times are different, copy the more recently modified file into the other directory */
+    
+    else if(srcItem->itemStat.st_mtime > destItem->itemStat.st_mtime) {
+      printTimes(w, srcItem, destItem);
+      printOutput(w, "Source version of %s newer than destination version: copying\n", destItem->name);
+      scheduleCopy(w, src,dest,srcItem);
+      addFile(destFileArray, srcItem->name, &srcItem->itemStat);
+    } 
+    else {
+      printTimes(w, srcItem, destItem);
+      printOutput(w, "Destination version of %s newer than source version: copying\n", destItem->name);
+      scheduleCopy(w, dest,src,destItem);
+      addFile(srcFileArray, destItem->name, &destItem->itemStat);
+    }
+  }
+  
+}
+/******************************************************************
+ * We do not want to copy a directory into itself or into a subdirectory of
+ * itself -- this will cause infinite loops. unsafeToCopy returns 1 if 
+ * it will be unsafe to copy the fileItem pointed to by srcItem into the 
+ * directory named by destpath. On error, it returns -1. Otherwise, it returns 0. */
+
+static int unsafeToCopy(dirsyncWorker *w, fileItem *srcItem, char *destpath) {
+  DIR *dir_ptr;
+  struct dirent *dirent_ptr;
+  struct stat thisstat;
+  
+  char path[w->pathsize];
+  
+  if((dir_ptr = opendir(destpath)) == NULL) {
+    printError(w, "opendir", destpath);
+    return -1;
+  }
+  
+  if(stat(destpath,&thisstat)) {
+    printError(w, "stat",destpath);
+    closedir(dir_ptr);
+    return -1;
+  }
+  
+  /*If they have the same ino, they are the same */
+  if(thisstat.st_ino == srcItem->itemStat.st_ino) {
+    printOutput(w, "Src and dest are the same -- no copy possible\n");
+    closedir(dir_ptr);
+    return 1;
+  }
+  
+  /*If not, we will keep going up one directory by opening '..' until
+   * we either determine that the inode matches something further up 
+   * (in which case it is not safe to copy) or [xxx] == [xxx]/..
+   * (in which case we are at the root, and if there 
+   * haven't been any problems, it's safe to copy) */
+  
+  else {
+    
+    while((dirent_ptr = readdir(dir_ptr)) != NULL) {
+      if(strcmp("..",dirent_ptr->d_name) == 0)
+	break;
+    }
+    
+    //a directory removed while we were looking at it has no '..'
+    if(dirent_ptr == NULL) {
+      closedir(dir_ptr);
+      return -1;
+    }
+    
+    if(thisstat.st_ino == dirent_ptr->d_ino) {
+      closedir(dir_ptr);
+      return 0;
+    }
+    
+    else if(dirent_ptr->d_ino == srcItem->itemStat.st_ino) {
+      printOutput(w, "Unsafe to copy a directory to its own subdirectory\n");
+      closedir(dir_ptr);
+      return 1;
+    }
+    
+    makeAbsPath(path,destpath,dirent_ptr->d_name);
+    closedir(dir_ptr);
+    return(unsafeToCopy(w, srcItem,path));
+  }
+  
+  return 0;
+}
+
+/******************************************************************
+ * moveNeededDirs is like moveNeededFiles, except that it deals with 
+ * subdirectories. Any subdirectories present in srcDir but not in destDir
+ * will be copied to destDir. src and dest should be the pathnames for 
+ * srcDir and destDir, respectively.
+ */
+static void moveNeededDirs(dirsyncWorker *w, Directory *srcDir, char *src, Directory *destDir, char *dest) {
+  fileList *srcDirArray = srcDir->subdirs;
+  fileList *destDirArray = destDir->subdirs;
+  
+  fileItem *srcItem, *destItem;
+  int i;
+  
+  char srcpath[w->pathsize],destpath[w->pathsize];
+  
+  for(i = 0; i < srcDir->subdirs->len; i++) {
+    srcItem = srcDirArray->dataStart[i];
+    destItem = itemFind(destDirArray,srcItem);
+    
+    int unsafe = 0;
+    
+    //Ignore '.' and '..' directories
+    if(strcmp(srcItem->name,".") == 0 || strcmp(srcItem->name,"..") == 0) {
+      continue;
+    }
+    
+    makeAbsPath(srcpath,src,srcItem->name);
+    makeAbsPath(destpath,dest,srcItem->name);        
+    
+    
+    /*If it was not found, it should be copied and added to the list of destination subdirs
+     *	unless it is unsafe -- i.e., copying it would lead to an infinite loop. */
+    if(!destItem) {
+      
+      if(unsafeToCopy(w, srcItem,dest)) {
+	unsafe = 1;
+	printOutput(w, "Cannot copy %s to %s\n", srcpath, destpath);
+      } else {
+	printOutput(w, "%s does not exist in dest directory: copying...\n", srcItem->name);
+	mode_t srcmode = srcItem->itemStat.st_mode;
+	if(mkdir(destpath,srcmode)) {
+	  printError(w, "mkdir", destpath);
+	} else {
+	  emitCopy(w, DIRSYNC_EVENT_MKDIR, srcpath, destpath, 0);
+	}
+	copyStat(w, destpath, &srcItem->itemStat);
+	recordItem(w, destpath);
+	addFile(destDirArray, srcItem->name, &srcItem->itemStat);
+      }
+    }
+    
+    /*If it was found, we don't need to copy, but still need to check the contents*/
+    else {
+      printOutput(w, "%s is in source directory: now checking...\n", srcItem->name);
+    }
+    
+    /* Now if we copied the subdirectory, or if it already existed, 
+     * call dirsync to ensure that the contents will be identical.
+     * Don't try to do this if we blocked the directory from being 
+     * created -- only errors will result.
+     */
+    if(!unsafe) {
+      dirsync(w, destpath,srcpath);
+      copyStat(w, destpath, &srcItem->itemStat); // dirsync will change times -- need to reset them
+      if(w->ctx->extentOrder) {
+	addFixup(w, destpath, &srcItem->itemStat); // and so will the queued copies
+      }
+    }
+    
+  }
+}
+/******************************************************************
+ * addPendingDone records that dir1 and dir2 have been walked and all of 
+ * their copies queued, so that flushQueue can mark them finished in 
+ * the journal once the copies are done.
+ */
+static void addPendingDone(dirsyncWorker *w, char *dir1, char *dir2) {
+  if(w->syncjournal == NULL) {
+    return;
+  }
+  
+  if((w->doneLen + 2) > w->doneReserved) {
+    unsigned int newsize = w->doneReserved * 2;
+    w->doneReserved = (newsize > MIN_FILELIST_SIZE) ? newsize : MIN_FILELIST_SIZE;
+    w->doneKeys = realloc(w->doneKeys, w->doneReserved * sizeof(char *));
+  }
+  
+  w->doneKeys[w->doneLen++] = strdup(dir1);
+  w->doneKeys[w->doneLen++] = strdup(dir2);
+}
+
+/******************************************************************
+ * flushQueue runs the queued copies, then the directory fixups, and 
+ * then marks the pairs of directories recorded by addPendingDone finished 
+ * in the journal, since nothing is left to do in them.
+ */
+static void flushQueue(dirsyncWorker *w) {
+  unsigned int i;
+  
+  runQueue(w);
+  runFixups(w);
+  
+  for(i = 0; i < w->doneLen; i += 2) {
+    journalMarkDone(w->syncjournal, w->doneKeys[i], w->doneKeys[i + 1]);
+    free(w->doneKeys[i]);
+    free(w->doneKeys[i + 1]);
+  }
+  w->doneLen = 0;
+}
+
+/******************************************************************
+ * dirsync takes two directories dir1 and dir2, and attempts to sync
+ * them. Any files present in one but not the other will be copied 
+ * appropriately, as will any subdirectories, unless an attempt is
+ * made to copy a directory to itself or to a subdirectory of itself.
+ * Symbolic links will not be followed but will be copied, although the 
+ * modification times for symlinks will not be identical across directories.
+ */
+
+static int dirsync(dirsyncWorker *w, char *src, char *dest) {
+  
+  /*An interrupted run that got through this pair of directories has nothing left to do here*/
+  if(journalSubtreeDone(w->syncjournal, src, dest)) {
+    printOutput(w, "\n%s and %s were already synced before the last run stopped: skipping\n", src, dest);
+    return 0;
+  }
+  
+  Directory *srcDir = calloc(1,sizeof(Directory));
+  Directory *destDir = calloc(1,sizeof(Directory));
+  
+  printOutput(w, "\nNow syncing from %s to %s\n\n", src, dest);
+  
+  //first make filelists
+  if(makeDirectory(w, src, srcDir)) {
+    printError(w, "makeDirectory", src);
+  }
+  
+  if(makeDirectory(w, dest, destDir)) {
+    printError(w, "makeDirectory", src);
+  }
+  
+  //move files from dest to src
+  moveNeededFiles(w, destDir, dest, srcDir, src);
+  
+  // move files from src to dest
+  moveNeededFiles(w, srcDir, src, destDir, dest);
+  
+  //move dirs from dest to src
+  moveNeededDirs(w, destDir, dest, srcDir, src);
+  
+  // move dirs from src to dest
+  moveNeededDirs(w, srcDir, src, destDir, dest);
+  
+  freeDir(srcDir);
+  freeDir(destDir);
+  
+  //with copies queued, the pair is not finished until the queue has run
+  if(w->ctx->extentOrder) {
+    addPendingDone(w, src, dest);
+  } else {
+    journalMarkDone(w->syncjournal, src, dest);
+  }
+  
+  return 0; 
+  
+}
+
+/******************************************************************
+ * walkSide adds a record for every regular file and directory below 
+ * dir, which is rel inside the job's directory number side, to the 
+ * rename map's records for this sync. The walk uses makeDirectory, 
+ * so it skips the same names the sync does.
+ */
+static void walkSide(dirsyncWorker *w, int side, char *dir, const char *rel) {
+  Directory *walkDir = calloc(1,sizeof(Directory));
+  char path[w->pathsize];
+  char relpath[w->pathsize];
+  fileItem *item;
+  int i;
+  
+  if(makeDirectory(w, dir, walkDir) == 0) {
+    for(i = 0; i < walkDir->files->len; i++) {
+      item = walkDir->files->dataStart[i];
+      if(S_ISREG(item->itemStat.st_mode)) {
+	renameAdd(w->renames, side, (*rel) ? makeAbsPath(relpath, (char *)rel, item->name) : item->name, &item->itemStat);
+      }
+    }
+    
+    for(i = 0; i < walkDir->subdirs->len; i++) {
+      item = walkDir->subdirs->dataStart[i];
+      if(strcmp(item->name,".") == 0 || strcmp(item->name,"..") == 0) {
+	continue;
+      }
+      
+      if(*rel) {
+	makeAbsPath(relpath, (char *)rel, item->name);
+      } else {
+	strcpy(relpath, item->name);
+      }
+      renameAdd(w->renames, side, relpath, &item->itemStat);
+      walkSide(w, side, makeAbsPath(path, dir, item->name), relpath);
+    }
+  }
+  
+  freeDir(walkDir);
+}
+
+/******************************************************************
+ * hashFile returns a 64-bit FNV-1a hash of the contents of the file 
+ * at path, read through the worker's buffer. 0 is never a hash, and 
+ * is returned if the file cannot be read.
+ */
+static unsigned long long hashFile(dirsyncWorker *w, char *path) {
+  unsigned long long hash = FNV_OFFSET;
+  ssize_t readlen;
+  int fd;
+  
+  if((fd = open(path, O_RDONLY)) < 0) {
+    printError(w, "open", path);
+    return 0;
+  }
+  
+  while((readlen = read(fd, w->buffer, COPY_BUFFER_SIZE)) != 0) {
+    if(readlen < 0) {
+      if(errno == EINTR) {
+	continue;
+      }
+      printError(w, "read", path);
+      close(fd);
+      return 0;
+    }
+    hash = fnvHash(hash, w->buffer, readlen);
+  }
+  
+  close(fd);
+  return hash ? hash : 1;
+}
+
+/******************************************************************
+ * makeParents creates any missing directories between the job's 
+ * directory number side and path, so that path can be renamed into 
+ * place. The sync that follows gives them the right permissions 
+ * and times.
+ */
+static void makeParents(dirsyncWorker *w, int side, char *path) {
+  size_t rootlen = strlen((side == 1) ? w->job->dir1 : w->job->dir2);
+  char *slash;
+  
+  for(slash = strchr(path + rootlen + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if(mkdir(path, S_IRWXU) && errno != EEXIST) {
+      printError(w, "mkdir", path);
+    }
+    *slash = '/';
+  }
+}
+
+/******************************************************************
+ * removeEmptyParents removes the directories that held rel on side, 
+ * from the deepest up, as long as they are empty and no longer exist 
+ * on the other side, so that moving everything out of a directory on 
+ * one side does not leave an empty copy of it behind on the other.
+ */
+static void removeEmptyParents(dirsyncWorker *w, int side, const char *rel) {
+  char dir[w->pathsize];
+  char path[w->pathsize];
+  struct stat dirstat;
+  char *slash;
+  
+  strcpy(dir, rel);
+  while((slash = strrchr(dir, '/')) != NULL) {
+    *slash = '\0';
+    if(lstat(makeSidePath(w, path, 3 - side, dir), &dirstat) == 0) {
+      break;
+    }
+    if(rmdir(makeSidePath(w, path, side, dir))) {
+      break;
+    }
+    printOutput(w, "Removed empty directory %s\n", path);
+  }
+}
+
+/******************************************************************
+ * moveOther repeats, on the other side, a move of the file or 
+ * directory current from oldrel on its own side. The other side's 
+ * oldrel must still be there, and for a file it must have current's 
+ * size and, unless verified says its contents have already been 
+ * compared, its modification time. If oldrel still exists on 
+ * current's side as the same file, the file has gained a hard link 
+ * rather than moved, so a hard link is made instead of a rename. 
+ * Returns 1 if the other side was changed, and 0 otherwise.
+ */
+static int moveOther(dirsyncWorker *w, renameRecord *current, const char *oldrel, int verified) {
+  char oldpath[w->pathsize];
+  char newpath[w->pathsize];
+  char srcpath[w->pathsize];
+  struct stat otherstat, srcstat;
+  int other = 3 - current->side;
+  int linked = 0;
+  
+  makeSidePath(w, oldpath, other, oldrel);
+  makeSidePath(w, newpath, other, current->path);
+  
+  //the other side already has something under the new name
+  if(lstat(newpath, &otherstat) == 0 || lstat(oldpath, &otherstat) != 0) {
+    return 0;
+  }
+  
+  if(current->isdir) {
+    if(!S_ISDIR(otherstat.st_mode)) {
+      return 0;
+    }
+  } else if(!S_ISREG(otherstat.st_mode) || otherstat.st_size != current->size ||
+	    (!verified && otherstat.st_mtime != current->mtime)) {
+    return 0;
+  }
+  
+  if(lstat(makeSidePath(w, srcpath, current->side, oldrel), &srcstat) == 0 &&
+     srcstat.st_dev == current->dev && srcstat.st_ino == current->ino) {
+    if(current->isdir) {
+      return 0;
+    }
+    linked = 1;
+  }
+  
+  makeParents(w, other, newpath);
+  
+  if(linked) {
+    if(link(oldpath, newpath)) {
+      printError(w, "link", newpath);
+      return 0;
+    }
+    printOutput(w, "%s is a new link to %s: linking %s to %s\n", current->path, oldrel, newpath, oldpath);
+    emitCopy(w, DIRSYNC_EVENT_LINK, oldpath, newpath, current->size);
+  } else {
+    if(rename(oldpath, newpath)) {
+      printError(w, "rename", newpath);
+      return 0;
+    }
+    printOutput(w, "%s was moved to %s: renaming %s to %s\n", oldrel, current->path, oldpath, newpath);
+    emitCopy(w, DIRSYNC_EVENT_RENAME, oldpath, newpath, current->size);
+    removeEmptyParents(w, other, oldrel);
+  }
+  
+  //contents matched by hash may still differ in times and permissions
+  if(verified && lstat(makeSidePath(w, srcpath, current->side, current->path), &srcstat) == 0) {
+    copyStat(w, newpath, &srcstat);
+  }
+  
+  return 1;
+}
+
+/******************************************************************
+ * moveByHash looks for a file that was on the other side of the last 
+ * sync, under a name that has since disappeared from current's side, 
+ * with the same size and contents as current. This catches moves 
+ * that changed the file's inode, such as across filesystems. Hashes 
+ * are only computed for files of the right size, and are saved in 
+ * the rename map for next time. Returns 1 if a file was moved.
+ */
+static int moveByHash(dirsyncWorker *w, renameRecord *current) {
+  char path[w->pathsize];
+  struct stat itemstat;
+  unsigned long long hash = 0;
+  int other = 3 - current->side;
+  renameRecord *candidate;
+  
+  for(candidate = renameFindSize(w->renames, other, current->size, NULL); candidate != NULL;
+      candidate = renameFindSize(w->renames, other, current->size, candidate)) {
+    if(candidate->isdir || strcmp(candidate->path, current->path) == 0) {
+      continue;
+    }
+    
+    //if the old name is still on this side, the file was copied, not moved
+    if(lstat(makeSidePath(w, path, current->side, candidate->path), &itemstat) == 0) {
+      continue;
+    }
+    
+    if(lstat(makeSidePath(w, path, other, candidate->path), &itemstat) != 0 || itemstat.st_ino != candidate->ino ||
+       itemstat.st_size != candidate->size || itemstat.st_mtime != candidate->mtime) {
+      continue;
+    }
+    
+    if(candidate->hash == 0) {
+      candidate->hash = hashFile(w, path);
+    }
+    if(hash == 0) {
+      hash = hashFile(w, makeSidePath(w, path, current->side, current->path));
+    }
+    
+    if(hash != 0 && hash == candidate->hash && moveOther(w, current, candidate->path, 1)) {
+      return 1;
+    }
+  }
+  
+  return 0;
+}
+
+/******************************************************************
+ * fileMoveConfirmed checks that the file current really is the one 
+ * the map last saw at old's path, and not a new file that was given 
+ * the inode of one since removed, with the same size and, as after 
+ * tar -x or cp -p, the same modification time. If old's path still 
+ * has the same inode on current's side, the file has gained a hard 
+ * link and is the same file. Otherwise current's contents must hash 
+ * the same as old's did, using the hash saved in the map if there is 
+ * one, or the hash of the other side's copy of old's path if not. 
+ * The hash is kept in both records, so the next sync only has to 
+ * read the file once. Nothing is hashed if the other side 
+ * already has something at current's path, since moveOther would 
+ * refuse the move anyway.
+ */
+static int fileMoveConfirmed(dirsyncWorker *w, renameRecord *current, renameRecord *old) {
+  char path[w->pathsize];
+  struct stat itemstat;
+  unsigned long long oldhash = old->hash;
+  int other = 3 - current->side;
+  
+  if(lstat(makeSidePath(w, path, other, current->path), &itemstat) == 0) {
+    return 0;
+  }
+  
+  if(lstat(makeSidePath(w, path, current->side, old->path), &itemstat) == 0 &&
+     itemstat.st_dev == current->dev && itemstat.st_ino == current->ino) {
+    return 1;
+  }
+  
+  if(oldhash == 0) {
+    if(lstat(makeSidePath(w, path, other, old->path), &itemstat) != 0 || !S_ISREG(itemstat.st_mode) ||
+       itemstat.st_size != current->size) {
+      return 0;
+    }
+    oldhash = hashFile(w, path);
+  }
+  
+  if(current->hash == 0) {
+    current->hash = hashFile(w, makeSidePath(w, path, current->side, current->path));
+  }
+  
+  if(oldhash == 0 || oldhash != current->hash) {
+    return 0;
+  }
+  
+  //saveRenameMap carries the hash over from old, if the walk has to be repeated
+  old->hash = oldhash;
+  return 1;
+}
+
+/******************************************************************
+ * dirMoveConfirmed checks that the directory current really is the 
+ * one the map last saw at old's path, and not a new directory that 
+ * was given the inode of one since removed, which some filesystems 
+ * reuse straight away. Everything the map recorded below old's path 
+ * is looked for under current's path on the same side, and the move 
+ * is only confirmed if more than half of it is there as the same 
+ * inode. The records below old's path are found by binary search 
+ * with renameFindChildren. An empty directory cannot be confirmed, 
+ * and is left to the sync, and nothing is looked up if the other 
+ * side already has current's path.
+ */
+static int dirMoveConfirmed(dirsyncWorker *w, renameRecord *current, renameRecord *old) {
+  char path[w->pathsize];
+  char rel[w->pathsize];
+  struct stat itemstat;
+  size_t oldlen = strlen(old->path);
+  renameRecord **children;
+  unsigned int i, count, found = 0;
+  
+  //every directory below a moved one looks moved too, but is already in place once its parent is
+  if(lstat(makeSidePath(w, path, 3 - current->side, current->path), &itemstat) == 0) {
+    return 0;
+  }
+  
+  children = renameFindChildren(w->renames, old->side, old->path, &count);
+  for(i = 0; i < count; i++) {
+    snprintf(rel, w->pathsize, "%s%s", current->path, children[i]->path + oldlen);
+    if(lstat(makeSidePath(w, path, current->side, rel), &itemstat) == 0 &&
+       itemstat.st_dev == children[i]->dev && itemstat.st_ino == children[i]->ino) {
+      found++;
+    }
+  }
+  
+  return count > 0 && found * 2 > count;
+}
+
+/******************************************************************
+ * detectRenames is the rename-detection pass run before a sync. It 
+ * walks both directories, and for each file or directory whose inode 
+ * the rename map last saw under a different name on the same side, 
+ * and whose move fileMoveConfirmed or dirMoveConfirmed confirms, 
+ * moves the other side's copy to the new name with moveOther, so 
+ * that dirsync neither copies the data again nor copies the old 
+ * name back. With content hashing on, new files the map has no 
+ * record of are matched by contents with moveByHash. If anything 
+ * was moved, the walk is repeated so the records match the disk.
+ */
+static void detectRenames(dirsyncWorker *w) {
+  renameMap *map = w->renames;
+  renameRecord *current, *old;
+  unsigned int i;
+  int moved = 0;
+  
+  printOutput(w, "\nLooking for files moved since the last sync of %s and %s\n\n", w->job->dir1, w->job->dir2);
+  
+  walkSide(w, 1, (char *)w->job->dir1, "");
+  walkSide(w, 2, (char *)w->job->dir2, "");
+  
+  for(i = 0; i < map->current.len; i++) {
+    current = &map->current.records[i];
+    old = renameFindId(map, current->side, current->dev, current->ino);
+    
+    if(old == NULL) {
+      if(w->ctx->renameHashing && !current->isdir && current->size > 0) {
+	moved += moveByHash(w, current);
+      }
+    }
+    else if(old->isdir == current->isdir && strcmp(old->path, current->path) != 0 &&
+	    (current->isdir ? dirMoveConfirmed(w, current, old) :
+	     (old->size == current->size && old->mtime == current->mtime && fileMoveConfirmed(w, current, old)))) {
+      moved += moveOther(w, current, old->path, 0);
+    }
+  }
+  
+  if(moved) {
+    renameClearCurrent(map);
+    walkSide(w, 1, (char *)w->job->dir1, "");
+    walkSide(w, 2, (char *)w->job->dir2, "");
+  }
+}
+
+/******************************************************************
+ * setPathSize sizes the worker's path buffers for a job, from the 
+ * maximum path length pathconf gives for either directory, capped 
+ * at MAX_PATH_SIZE.
+ */
+static void setPathSize(dirsyncWorker *w, char *dir1, char *dir2) {
+  long pathmax1 = pathconf(dir1, _PC_PATH_MAX);
+  long pathmax2 = pathconf(dir2, _PC_PATH_MAX);
+  long pathmax = (pathmax1 > pathmax2) ? pathmax1 : pathmax2;
+  
+  w->pathsize = DEFAULT_PATH_SIZE;
+  if(pathmax > 0) {
+    w->pathsize = (pathmax < MAX_PATH_SIZE) ? pathmax : MAX_PATH_SIZE;
+    printOutput(w, "Maximum path size changed to %ld\n", w->pathsize);
+  }
+}
+
+/******************************************************************
+ * runJob syncs one job of the batch on the worker w. Like the 
+ * dirsync program, it checks that both directories can be opened 
+ * before starting. Returns the number of errors reported.
+ */
+static int runJob(dirsyncWorker *w, int index) {
+  const dirsyncJob *job = &w->ctx->jobs[index];
+  char *dir1 = (char *)job->dir1;
+  char *dir2 = (char *)job->dir2;
+  DIR *dir_ptr;
+  
+  w->jobindex = index;
+  w->job = job;
+  w->syncjournal = NULL;
+  w->renames = NULL;
+  w->ownFileCount = 0;
+  w->errors = 0;
+  
+  dirsyncEvent event = {DIRSYNC_EVENT_JOB_START};
+  event.path = dir1;
+  event.destpath = dir2;
+  emitEvent(w, &event);
+  
+  if((dir_ptr = opendir(dir1)) == NULL) {
+    printError(w, "opendir", dir1);
+  } else {
+    closedir(dir_ptr);
+  }
+  
+  if((dir_ptr = opendir(dir2)) == NULL) {
+    printError(w, "opendir", dir2);
+  } else {
+    closedir(dir_ptr);
+  }
+  
+  setPathSize(w, dir1, dir2);
+  
+  if(w->errors == 0 && job->journal) {
+    if((w->syncjournal = openJournal(job->journal, dir1, dir2)) == NULL) {
+      printError(w, "openJournal", (char *)job->journal);
+    }
+    addOwnFile(w, job->journal);
+  }
+  
+  if(w->errors == 0 && job->renames) {
+    addOwnFile(w, job->renames);
+    
+    if((w->renames = loadRenameMap(job->renames, dir1, dir2)) == NULL) {
+      printError(w, "loadRenameMap", (char *)job->renames);
+    } else {
+      detectRenames(w);
+    }
+  }
+  
+  if(w->errors == 0) {
+    dirsync(w, dir1, dir2);
+    flushQueue(w);
+    runDrops(w);
+    
+    if(w->renames && saveRenameMap(w->renames, dir1, dir2)) {
+      printError(w, "saveRenameMap", (char *)job->renames);
+    }
+    
+    if(w->syncjournal && w->syncjournal->error) {
+      errno = w->syncjournal->error;
+      printError(w, "write", (char *)job->journal);
+    }
+    closeJournal(w->syncjournal, 1);
+    w->syncjournal = NULL;
+  }
+  
+  //a job that stopped before syncing keeps its journal for the next run
+  closeJournal(w->syncjournal, 0);
+  freeRenameMap(w->renames);
+  
+  event.type = DIRSYNC_EVENT_JOB_DONE;
+  event.errors = w->errors;
+  emitEvent(w, &event);
+  
+  return w->errors;
+}
+
+/******************************************************************
+ * getBuffer takes a copy buffer from the context's pool, or 
+ * allocates a new one, aligned for O_DIRECT, if the pool is empty. 
+ * Returns NULL if memory cannot be allocated.
+ */
+static char *getBuffer(dirsyncContext *ctx) {
+  void *buffer = NULL;
+  
+  pthread_mutex_lock(&ctx->lock);
+  if(ctx->poolLen > 0) {
+    buffer = ctx->pool[--ctx->poolLen];
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  
+  if(buffer == NULL && posix_memalign(&buffer, DIRECT_ALIGN, COPY_BUFFER_SIZE) != 0) {
+    return NULL;
+  }
+  return buffer;
+}
+
+/******************************************************************
+ * putBuffer returns buffer to the context's pool.
+ */
+static void putBuffer(dirsyncContext *ctx, char *buffer) {
+  if(buffer == NULL) {
+    return;
+  }
+  
+  pthread_mutex_lock(&ctx->lock);
+  if((ctx->poolLen + 1) > ctx->poolReserved) {
+    ctx->poolReserved = (ctx->poolReserved > 0) ? ctx->poolReserved * 2 : 4;
+    ctx->pool = realloc(ctx->pool, ctx->poolReserved * sizeof(char *));
+  }
+  ctx->pool[ctx->poolLen++] = buffer;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/******************************************************************
+ * runWorker is the body of each worker thread. It takes the next 
+ * job that no other worker has started, until there are none left.
+ */
+static void *runWorker(void *arg) {
+  dirsyncWorker *w = arg;
+  dirsyncContext *ctx = w->ctx;
+  int index;
+  
+  for(;;) {
+    pthread_mutex_lock(&ctx->lock);
+    index = ctx->nextjob++;
+    pthread_mutex_unlock(&ctx->lock);
+    
+    if(index >= ctx->njobs) {
+      break;
+    }
+    
+    if(runJob(w, index)) {
+      pthread_mutex_lock(&ctx->lock);
+      ctx->failed++;
+      pthread_mutex_unlock(&ctx->lock);
+    }
+  }
+  
+  return NULL;
+}
+
+dirsyncContext *dirsyncCreate() {
+  dirsyncContext *ctx = calloc(1, sizeof(dirsyncContext));
+  if(ctx == NULL) {
+    return NULL;
+  }
+  
+  ctx->verbose = 0;
+  ctx->threads = 1;
+  ctx->callback = dirsyncPrintEvent;
+  ctx->userdata = NULL;
+  pthread_mutex_init(&ctx->lock, NULL);
+  
+  /*Temporary files from interrupted copies are never synced*/
+  ctx->filter = makeFilter();
+  filterAddPattern(ctx->filter, "*" PARTIAL_SUFFIX, 0);
+  
+  return ctx;
+}
+
+void dirsyncDestroy(dirsyncContext *ctx) {
+  if(ctx == NULL) {
+    return;
+  }
+  
+  while(ctx->poolLen > 0) {
+    free(ctx->pool[--ctx->poolLen]);
+  }
+  free(ctx->pool);
+  
+  freeFilter(ctx->filter);
+  pthread_mutex_destroy(&ctx->lock);
+  free(ctx);
+}
+
+void dirsyncSetVerbose(dirsyncContext *ctx, int verbose) {
+  ctx->verbose = verbose;
+}
+
+void dirsyncSetRenameHashing(dirsyncContext *ctx, int hashing) {
+  ctx->renameHashing = hashing;
+}
+
+void dirsyncSetNoCache(dirsyncContext *ctx, int nocache) {
+  ctx->noCache = nocache;
+}
+
+void dirsyncSetExtentOrder(dirsyncContext *ctx, int extentorder) {
+  ctx->extentOrder = extentorder;
+}
+
+void dirsyncSetThreads(dirsyncContext *ctx, int threads) {
+  ctx->threads = (threads > 1) ? threads : 1;
+}
+
+void dirsyncSetCallback(dirsyncContext *ctx, dirsyncCallback callback, void *userdata) {
+  ctx->callback = callback;
+  ctx->userdata = userdata;
+}
+
+int dirsyncAddFilter(dirsyncContext *ctx, const char *pattern, int include) {
+  return filterAddPattern(ctx->filter, pattern, include);
+}
+
+int dirsyncAddFilterFile(dirsyncContext *ctx, const char *path) {
+  return filterAddFromFile(ctx->filter, path);
+}
+
+int dirsyncRunBatch(dirsyncContext *ctx, const dirsyncJob *jobs, int njobs) {
+  int nworkers = (ctx->threads < njobs) ? ctx->threads : njobs;
+  int i, started;
+  
+  if(njobs <= 0) {
+    return 0;
+  }
+  
+  dirsyncWorker *workers = calloc(nworkers, sizeof(dirsyncWorker));
+  pthread_t *threads = calloc(nworkers, sizeof(pthread_t));
+  if(workers == NULL || threads == NULL) {
+    free(workers);
+    free(threads);
+    return -1;
+  }
+  
+  //the filter is only read from here on, so the workers can share it
+  compileFilter(ctx->filter);
+  
+  ctx->jobs = jobs;
+  ctx->njobs = njobs;
+  ctx->nextjob = 0;
+  ctx->failed = 0;
+  
+  for(i = 0; i < nworkers; i++) {
+    workers[i].ctx = ctx;
+    workers[i].buffer = getBuffer(ctx);
+    if(workers[i].buffer == NULL) {
+      nworkers = i;
+      break;
+    }
+  }
+  
+  /*A single worker runs on the calling thread. Otherwise the caller 
+   *waits while each worker runs on a thread of its own.*/
+  if(nworkers == 1) {
+    runWorker(&workers[0]);
+  } else if(nworkers > 1) {
+    for(started = 0; started < nworkers; started++) {
+      if(pthread_create(&threads[started], NULL, runWorker, &workers[started])) {
+	break;
+      }
+    }
+    
+    if(started == 0) {
+      runWorker(&workers[0]); // no threads could be created, so do the work here
+    }
+    
+    for(i = 0; i < started; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+  
+  for(i = 0; i < nworkers; i++) {
+    putBuffer(ctx, workers[i].buffer);
+    free(workers[i].queue);
+    free(workers[i].queueIndex);
+    free(workers[i].fixups);
+    free(workers[i].fixupIndex);
+    free(workers[i].doneKeys);
+    free(workers[i].drops);
+  }
+  free(workers);
+  free(threads);
+  
+  return (nworkers == 0) ? -1 : ctx->failed;
+}
+
+int dirsyncRun(dirsyncContext *ctx, const char *dir1, const char *dir2, const char *journalpath) {
+  dirsyncJob job;
+  
+  job.dir1 = dir1;
+  job.dir2 = dir2;
+  job.journal = journalpath;
+  job.renames = NULL;
+  
+  return dirsyncRunBatch(ctx, &job, 1) ? 1 : 0;
+}
+
+void dirsyncPrintEvent(const dirsyncEvent *event, void *userdata) {
+  switch(event->type) {
+    case DIRSYNC_EVENT_MESSAGE:
+      fputs(event->message, stdout);
+      break;
+    case DIRSYNC_EVENT_ERROR:
+      fprintf(stderr,"Error trying to call %s with argument %s: %s\n",event->function,event->path,strerror(event->error));
+      break;
+    default:
+      break;
+  }
+}
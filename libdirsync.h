@@ -0,0 +1,186 @@
+#ifndef LIBDIRSYNC_H
+#define LIBDIRSYNC_H
+
+/******************************************************************
+ * libdirsync is the sync engine behind the dirsync program, for
+ * use by programs that run many syncs without starting a process
+ * for each one. All of the state for a run lives in a
+ * dirsyncContext, so separate contexts can be used from separate
+ * threads, and a single context runs a batch of jobs on a pool of
+ * worker threads. Copy buffers are kept by the context and reused
+ * from one job, and one batch, to the next.
+ */
+
+/******************************************************************
+ * The library is built with -fvisibility=hidden, so that its 
+ * internal functions cannot clash with the program using it. Only 
+ * the functions declared with DIRSYNC_API are exported.
+ */
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define DIRSYNC_API __attribute__((visibility("default")))
+#else
+#define DIRSYNC_API
+#endif
+
+/******************************************************************
+ * The kinds of event reported to a dirsyncCallback:
+ *   DIRSYNC_EVENT_MESSAGE: a line of verbose output, in message.
+ *   DIRSYNC_EVENT_ERROR: a call to function failed on path, with
+ *     the errno value in error.
+ *   DIRSYNC_EVENT_COPY_START, DIRSYNC_EVENT_COPY_PROGRESS and
+ *     DIRSYNC_EVENT_COPY_DONE: path is being copied to destpath,
+ *     and bytes of it have been copied so far.
+ *   DIRSYNC_EVENT_MKDIR: the directory destpath was created as a
+ *     copy of path.
+ *   DIRSYNC_EVENT_RENAME and DIRSYNC_EVENT_LINK: the rename
+ *     detection pass renamed or hard linked path to destpath
+ *     instead of copying bytes of data.
+ *   DIRSYNC_EVENT_JOB_START and DIRSYNC_EVENT_JOB_DONE: a job in
+ *     the batch started or finished, with errors set to the number
+ *     of errors reported for it.
+ */
+
+typedef enum dirsyncEventType {
+  DIRSYNC_EVENT_MESSAGE,
+  DIRSYNC_EVENT_ERROR,
+  DIRSYNC_EVENT_COPY_START,
+  DIRSYNC_EVENT_COPY_PROGRESS,
+  DIRSYNC_EVENT_COPY_DONE,
+  DIRSYNC_EVENT_MKDIR,
+  DIRSYNC_EVENT_RENAME,
+  DIRSYNC_EVENT_LINK,
+  DIRSYNC_EVENT_JOB_START,
+  DIRSYNC_EVENT_JOB_DONE
+} dirsyncEventType;
+
+/******************************************************************
+ * A dirsyncEvent describes one event. job is the index of the job
+ * in the batch it belongs to. Fields that do not apply to the
+ * event's type are NULL or 0, and the strings are only valid
+ * until the callback returns.
+ */
+
+typedef struct dirsyncEvent {
+  dirsyncEventType type;
+  int job;
+  const char *message;
+  const char *function;
+  const char *path;
+  const char *destpath;
+  long long bytes;
+  int error;
+  int errors;
+} dirsyncEvent;
+
+/******************************************************************
+ * A dirsyncCallback receives every event for a context, along
+ * with the userdata pointer given to dirsyncSetCallback. Calls are
+ * made from the worker threads, but never more than one at a time.
+ */
+typedef void (*dirsyncCallback)(const dirsyncEvent *event, void *userdata);
+
+/******************************************************************
+ * A dirsyncJob is a pair of directories to sync. If journal is
+ * not NULL, the job keeps a journal there so that it can be
+ * resumed if it is interrupted. If renames is not NULL, the job
+ * keeps a map of the files it has seen there, and uses it to find
+ * files that have been moved or renamed since the last sync.
+ */
+
+typedef struct dirsyncJob {
+  const char *dir1;
+  const char *dir2;
+  const char *journal;
+  const char *renames;
+} dirsyncJob;
+
+typedef struct dirsyncContext dirsyncContext;
+
+/******************************************************************
+ * dirsyncCreate returns a new context with verbose output off, one
+ * worker thread, no filter patterns, and dirsyncPrintEvent as its
+ * callback. It returns NULL if memory cannot be allocated.
+ */
+DIRSYNC_API dirsyncContext *dirsyncCreate();
+
+/******************************************************************
+ * dirsyncDestroy frees the given context. It must not be called
+ * while a batch is running on it.
+ */
+DIRSYNC_API void dirsyncDestroy(dirsyncContext *ctx);
+
+/******************************************************************
+ * dirsyncSetVerbose turns DIRSYNC_EVENT_MESSAGE events on if
+ * verbose is non-zero, and off otherwise.
+ */
+DIRSYNC_API void dirsyncSetVerbose(dirsyncContext *ctx, int verbose);
+
+/******************************************************************
+ * dirsyncSetRenameHashing lets jobs with a rename map match moved
+ * files by their contents when their inode has changed, if hashing
+ * is non-zero.
+ */
+DIRSYNC_API void dirsyncSetRenameHashing(dirsyncContext *ctx, int hashing);
+
+/******************************************************************
+ * dirsyncSetNoCache turns on, if nocache is non-zero, a copy mode
+ * that keeps a sync from filling the page cache: sources are read
+ * sequentially and dropped from the cache behind the copy, and
+ * large files are written with O_DIRECT where the filesystem
+ * supports it, or flushed and dropped as they are written if not.
+ */
+DIRSYNC_API void dirsyncSetNoCache(dirsyncContext *ctx, int nocache);
+
+/******************************************************************
+ * dirsyncSetExtentOrder, if extentorder is non-zero, makes each job
+ * put off copying files until it has found every file it needs to
+ * copy, and then copy them in the order their data is laid out on
+ * disk. This saves seeking on rotational disks.
+ */
+DIRSYNC_API void dirsyncSetExtentOrder(dirsyncContext *ctx, int extentorder);
+
+/******************************************************************
+ * dirsyncSetThreads sets the number of worker threads a batch is
+ * run on. Values below 1 are treated as 1.
+ */
+DIRSYNC_API void dirsyncSetThreads(dirsyncContext *ctx, int threads);
+
+/******************************************************************
+ * dirsyncSetCallback sets the function events are reported to.
+ * A NULL callback discards all events.
+ */
+DIRSYNC_API void dirsyncSetCallback(dirsyncContext *ctx, dirsyncCallback callback, void *userdata);
+
+/******************************************************************
+ * dirsyncAddFilter adds an include (if include is non-zero) or
+ * exclude glob pattern, and dirsyncAddFilterFile adds the patterns
+ * in the file named by path, as for dirsync's --include, --exclude
+ * and --exclude-from options. Both return 0 on success and -1 on
+ * error, with errno set to EINVAL for an invalid pattern.
+ */
+DIRSYNC_API int dirsyncAddFilter(dirsyncContext *ctx, const char *pattern, int include);
+DIRSYNC_API int dirsyncAddFilterFile(dirsyncContext *ctx, const char *path);
+
+/******************************************************************
+ * dirsyncRunBatch syncs each of the njobs jobs, sharing them out
+ * among the context's worker threads, and returns once they are
+ * all finished. It returns the number of jobs that had errors, or
+ * -1 if the workers could not be started.
+ */
+DIRSYNC_API int dirsyncRunBatch(dirsyncContext *ctx, const dirsyncJob *jobs, int njobs);
+
+/******************************************************************
+ * dirsyncRun syncs dir1 and dir2 as a batch of one job, keeping a
+ * journal at journalpath if it is not NULL. It returns 0 if there
+ * were no errors, and 1 otherwise.
+ */
+DIRSYNC_API int dirsyncRun(dirsyncContext *ctx, const char *dir1, const char *dir2, const char *journalpath);
+
+/******************************************************************
+ * dirsyncPrintEvent is the default callback. It prints messages
+ * to stdout and errors to stderr, the way the dirsync program
+ * always has, and ignores other events.
+ */
+DIRSYNC_API void dirsyncPrintEvent(const dirsyncEvent *event, void *userdata);
+
+#endif